@@ -1,22 +1,39 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
 
 enum {
     word_init_size   = 4,
     line_init_size   = 16,
+    in_buf_size      = 65536,
+    arena_chunk_size = 4096,
+    var_table_size   = 256,
+    array_max_size   = 1 << 24,
     code_succ        = 0,
     code_quot_msmtch = 1,
+    code_incomplete  = 2,
+    code_syntax_err  = 3,
 };
 
 #define SELF_NAME "shell"
 
 int session_tty_fd;
+int in_subshell = 0;    /* raised in forked children of the shell */
+int last_status = 0;    /* value of `$?' */
+int last_bg_pid = 0;    /* value of `$!' */
+int shell_pid;          /* value of `$$', the same in subshells */
+sigset_t sigchld_mask;
 
 enum token_type { token_word, token_delimiter };
 
@@ -87,6 +104,116 @@ void dstr_append(struct dyn_str *dstr, char c)
     (dstr->pos)++;
 }
 
+void dstr_append_mem(struct dyn_str *dstr, const char *s, int len)
+{
+    if(dstr->pos + len > dstr->size) {
+        while(dstr->pos + len > dstr->size)
+            dstr->size *= 2;
+        dstr->str = realloc(dstr->str, dstr->size);
+    }
+    memcpy(dstr->str + dstr->pos, s, len);
+    dstr->pos += len;
+}
+
+void dstr_append_str(struct dyn_str *dstr, const char *s)
+{
+    dstr_append_mem(dstr, s, strlen(s));
+}
+
+/* terminates the string and hands its buffer over to the caller */
+char *dstr_finish(struct dyn_str *dstr)
+{
+    dstr_append(dstr, '\0');
+    return dstr->str;
+}
+
+/* Parse trees are allocated from an arena, so a whole command (or a
+ * function body) is released at once and loop bodies are executed again
+ * and again without being tokenized or parsed anew. */
+
+struct arena_chunk {
+    char *data;
+    size_t used, size;
+    struct arena_chunk *next;
+};
+
+struct arena_cleanup {
+    void (*fn)(void *arg);
+    void *arg;
+    struct arena_cleanup *next;
+};
+
+struct arena {
+    struct arena_chunk *chunks;
+    struct arena_cleanup *cleanups;
+    int refs;
+};
+
+struct arena *arena_new()
+{
+    struct arena *a;
+    a = malloc(sizeof(*a));
+    a->chunks = NULL;
+    a->cleanups = NULL;
+    a->refs = 1;
+    return a;
+}
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+    struct arena_chunk *ch;
+    void *res;
+    n = (n + 15) & ~(size_t)15;
+    ch = a->chunks;
+    if(!ch || ch->used + n > ch->size) {
+        ch = malloc(sizeof(*ch));
+        ch->size = n > arena_chunk_size ? n : arena_chunk_size;
+        ch->data = malloc(ch->size);
+        ch->used = 0;
+        ch->next = a->chunks;
+        a->chunks = ch;
+    }
+    res = ch->data + ch->used;
+    ch->used += n;
+    return res;
+}
+
+char *arena_strndup(struct arena *a, const char *s, int len)
+{
+    char *res;
+    res = arena_alloc(a, len + 1);
+    memcpy(res, s, len);
+    res[len] = '\0';
+    return res;
+}
+
+/* registers a function to release memory the arena objects refer to */
+void arena_on_release(struct arena *a, void (*fn)(void *arg), void *arg)
+{
+    struct arena_cleanup *cl;
+    cl = arena_alloc(a, sizeof(*cl));
+    cl->fn = fn;
+    cl->arg = arg;
+    cl->next = a->cleanups;
+    a->cleanups = cl;
+}
+
+void arena_release(struct arena *a)
+{
+    struct arena_cleanup *cl;
+    if(--(a->refs) > 0)
+        return;
+    for(cl = a->cleanups; cl; cl = cl->next)
+        cl->fn(cl->arg);
+    while(a->chunks) {
+        struct arena_chunk *tmp = a->chunks;
+        a->chunks = tmp->next;
+        free(tmp->data);
+        free(tmp);
+    }
+    free(a);
+}
+
 int is_whitespace(char c)
 {
     return c == ' ' || c == '\t';
@@ -102,16 +229,18 @@ void add_word_to_wlist(struct dyn_str *dstr, struct word_list *wlist,
 int is_delimiter(char c)
 {
     return c == '&' || c == '>' || c == '<' || c == '|' || c == ';' ||
-           c == '(' || c == ')';
+           c == '(' || c == ')' || c == '\n';
 }
 
 int delimiter_len(char *c)
 {
     /* 1 or 2
-       & > < | ; ( )
-       >> && ||
+       & > < | ; ( ) \n
+       >> && || ;; |+
     */
-    if(*c == c[1] && (*c == '>' || *c == '&' || *c == '|'))
+    if(*c == c[1] && (*c == '>' || *c == '&' || *c == '|' || *c == ';'))
+        return 2;
+    if(*c == '|' && c[1] == '+')
         return 2;
     return 1;
 }
@@ -130,137 +259,345 @@ void add_delimiter_to_wlist(char **c, struct dyn_str *dword,
     for(i = 0; i < dlen; i++)
         dstr_append(dword, (*c)[i]);
     add_word_to_wlist(dword, wlist, token_delimiter);
-    /* init another word if it's not the end of line */
-    if((*c)[dlen])
-        dstr_init(dword, word_init_size);
+    dstr_init(dword, word_init_size);
     (*c) += dlen-1;
 }
 
+char *scan_parens(char *c);
+
+/* c points at a backquote; returns pointer to the closing one or NULL */
+char *scan_backquotes(char *c)
+{
+    for(c++; *c != '`'; c++) {
+        if(!*c)
+            return NULL;
+        if(*c == '\\' && c[1])
+            c++;
+    }
+    return c;
+}
+
+/* c points at `"'; returns pointer to the closing quote or NULL */
+char *scan_dquotes(char *c)
+{
+    for(c++; *c != '"'; c++) {
+        if(!*c)
+            return NULL;
+        if(*c == '\\' && c[1]) {
+            c++;
+        } else if(*c == '$' && c[1] == '(') {
+            c = scan_parens(c+1);
+            if(!c)
+                return NULL;
+        } else if(*c == '`') {
+            c = scan_backquotes(c);
+            if(!c)
+                return NULL;
+        }
+    }
+    return c;
+}
+
+/* c points at `('; returns pointer to the matching `)' (quotes and
+ * nested parentheses are skipped) or NULL if there is no such */
+char *scan_parens(char *c)
+{
+    int depth = 0;
+    for(; *c; c++) {
+        if(*c == '\\' && c[1]) {
+            c++;
+        } else if(*c == '\'') {
+            c = strchr(c+1, '\'');
+            if(!c)
+                return NULL;
+        } else if(*c == '"') {
+            c = scan_dquotes(c);
+            if(!c)
+                return NULL;
+        } else if(*c == '`') {
+            c = scan_backquotes(c);
+            if(!c)
+                return NULL;
+        } else if(*c == '(') {
+            depth++;
+        } else if(*c == ')' && --depth == 0) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+int is_procsub_start(const char *c)
+{
+    return (*c == '<' || *c == '>') && c[1] == '(';
+}
+
+/* if c starts `((expr))', returns pointer to its last character */
+char *scan_double_parens(char *c)
+{
+    char *end;
+    if(c[0] != '(' || c[1] != '(')
+        return NULL;
+    end = scan_parens(c);
+    if(!end || end[-1] != ')' || scan_parens(c+1) != end-1)
+        return NULL;
+    return end;
+}
+
+/* Copies a quoted string, an escaped character or a single regular
+ * character starting at c to the dword; `<(...)', `>(...)', `$(...)' and
+ * `...` are copied as a whole.  Quotes are kept in the word: they are removed later, when
+ * the word is compiled.  Returns pointer to the last consumed character or
+ * NULL if a quote or a parenthesis is unmatched. */
+char *scan_word_unit(char *c, struct dyn_str *dword)
+{
+    char *start = c;
+    if(is_procsub_start(c) || (*c == '$' && c[1] == '(')) {
+        c = scan_parens(c+1);
+        if(!c)
+            return NULL;
+        dstr_append_mem(dword, start, c - start + 1);
+        return c;
+    }
+    switch(*c) {
+    case '\\':
+        if(!c[1])
+            return NULL;
+        c++;
+        break;
+    case '\'':
+        c = strchr(c+1, '\'');
+        if(!c)
+            return NULL;
+        break;
+    case '"':
+        c = scan_dquotes(c);
+        if(!c)
+            return NULL;
+        break;
+    case '`':
+        c = scan_backquotes(c);
+        if(!c)
+            return NULL;
+        break;
+    }
+    dstr_append_mem(dword, start, c - start + 1);
+    return c;
+}
+
 struct word_item *tokenize_line(char *line, int *status)
 {
-    char *c;
+    char *c, *end;
     struct dyn_str dword;
-    int in_quots = 0, is_word = 0, escaped = 0;
     struct word_list wlist = { NULL, NULL };
+    *status = code_succ;
     dstr_init(&dword, word_init_size);
     for(c = line; *c; c++) {
-        if(is_whitespace(*c) && !in_quots && is_word) {
-            add_word_to_wlist(&dword, &wlist, token_word);
-            dstr_init(&dword, word_init_size);
-            is_word = 0;
-        } else if(!in_quots && is_delimiter(*c)) {
-            add_delimiter_to_wlist(&c, &dword, &wlist);
-            is_word = 0;
-        } else if(*c == '\\' && !escaped && (c[1] == '\\' || c[1] == '"')) {
-            escaped = 1;
-        } else if(*c == '"' && !escaped) {
-            /* creating an empty word */
-            if(!is_word && c[1] == '"' && (c[2] == ' ' || c[2] == '\0')) {
-                is_word = 1;
-                c++;
-            } else {
-                in_quots = !in_quots;
+        if(*c == '\\' && c[1] == '\n') {
+            /* line continuation */
+            c++;
+            if(!c[1])
+                *status = code_incomplete;
+        } else if(is_whitespace(*c)) {
+            if(dword.pos != 0) {
+                add_word_to_wlist(&dword, &wlist, token_word);
+                dstr_init(&dword, word_init_size);
             }
+        } else if(*c == '#' && dword.pos == 0) {
+            while(c[1] && c[1] != '\n')
+                c++;
+        } else if(dword.pos == 0 && (end = scan_double_parens(c))) {
+            /* `((expr))' command is a single word */
+            dstr_append_mem(&dword, c, end - c + 1);
+            c = end;
+        } else if(is_delimiter(*c) && !is_procsub_start(c)) {
+            add_delimiter_to_wlist(&c, &dword, &wlist);
         } else {
-            if(!is_word && (!is_whitespace(*c) || in_quots))
-                is_word = 1;
-            if(is_word)
-                dstr_append(&dword, *c);
-            escaped = 0;
+            end = scan_word_unit(c, &dword);
+            if(!end) {
+                *status = code_quot_msmtch;
+                break;
+            }
+            c = end;
         }
     }
-    if(is_word)
+    if(dword.pos != 0 && *status == code_succ)
         add_word_to_wlist(&dword, &wlist, token_word);
-    if(status)
-        *status = in_quots ? code_quot_msmtch : code_succ;
-    if(!wlist.first)
+    else
         free(dword.str);
     return wlist.first;
 }
 
-char **wlist2arr(struct word_item *wlist, const int *wlen)
+struct var_item {
+    char *name, *value;
+    int exported;
+    char **elems;           /* elements of an indexed array */
+    int nelems;
+    struct var_item *next;
+};
+
+struct var_item *vars[var_table_size];
+
+unsigned var_hash(const char *name)
 {
-    int len, i;
-    char **arr;
-    struct word_item *tmp;
-    len = wlist_len(wlist) + 1;  /* +1 is for the NULL at the end of arr */
-    if(wlen && *wlen + 1 < len)
-        len = *wlen + 1;
-    if(len == 1)
-        return NULL;
-    arr = malloc(len * sizeof(*arr));
-    tmp = wlist;
-    for(i = 0; i < len-1; i++) {
-        arr[i] = tmp->word;
-        tmp = tmp->next;
-    }
-    arr[len-1] = NULL;
-    return arr;
+    unsigned h = 0;
+    for(; *name; name++)
+        h = h * 31 + (unsigned char)*name;
+    return h % var_table_size;
 }
 
-char *builtins[] = {
-    "cd",
-    "exit",
-    /* more builtin commands to come... */
-};
+struct var_item *var_lookup(const char *name)
+{
+    struct var_item *v;
+    for(v = vars[var_hash(name)]; v; v = v->next)
+        if(0 == strcmp(v->name, name))
+            return v;
+    return NULL;
+}
 
-int is_builtin(const char *cmd)
+const char *var_get(const char *name)
 {
-    int blen, i;
-    blen = sizeof(builtins) / sizeof(*builtins);
-    for(i = 0; i < blen; i++)
-        if(0 == strcmp(builtins[i], cmd))
-            return 1;
-    return 0;
+    struct var_item *v;
+    v = var_lookup(name);
+    if(v && v->elems)
+        return v->nelems ? v->elems[0] : NULL;
+    return v ? v->value : NULL;
 }
 
-int len_argv(char **argv)
+void var_free_elems(struct var_item *v)
 {
-    char **arg;
-    for(arg = argv; *arg; arg++)
-        {}
-    return arg - argv;
+    int i;
+    for(i = 0; i < v->nelems; i++)
+        free(v->elems[i]);
+    free(v->elems);
+    v->elems = NULL;
+    v->nelems = 0;
 }
 
-void cd(char **argv)
+struct var_item *var_set(const char *name, const char *value)
 {
-    int res, len;
-    char *path, *old_path;
-    len = len_argv(argv);
-    if(len > 2) {
-        fprintf(stderr, "%s: cd: too many arguments\n", SELF_NAME);
-        return;
-    } else if(len == 2) {
-        if(0 == strcmp(argv[1], "-")) {
-            path = getenv("OLDPWD");
-            if(!path) {
-                fprintf(stderr, "%s: cd: OLDPWD not set\n", SELF_NAME);
-                return;
-            }
-        } else {
-            path = argv[1];
-        }
-    } else {
-        path = getenv("HOME");
-        if(!path) {
-            fprintf(stderr, "%s: cd: HOME not set\n", SELF_NAME);
+    struct var_item *v;
+    v = var_lookup(name);
+    if(!v) {
+        unsigned h = var_hash(name);
+        v = malloc(sizeof(*v));
+        v->name = strdup(name);
+        v->value = NULL;
+        v->exported = 0;
+        v->elems = NULL;
+        v->nelems = 0;
+        v->next = vars[h];
+        vars[h] = v;
+    }
+    if(v->elems)
+        var_free_elems(v);
+    free(v->value);
+    v->value = strdup(value);
+    if(v->exported)
+        setenv(name, value, 1);
+    return v;
+}
+
+/* makes the variable an indexed array, taking ownership of elems */
+void var_set_array(const char *name, char **elems, int nelems)
+{
+    struct var_item *v;
+    v = var_set(name, "");
+    /* elems is never NULL for an array, even an empty one */
+    v->elems = elems ? elems : malloc(sizeof(*elems));
+    v->nelems = nelems;
+}
+
+/* sets element i of an indexed array; a scalar becomes its element 0,
+ * and elements skipped over are set to empty strings */
+void var_set_elem(const char *name, int i, const char *value)
+{
+    struct var_item *v;
+    char **elems;
+    v = var_lookup(name);
+    if(!v || !v->elems) {
+        if(i == 0) {
+            var_set(name, value);
             return;
         }
+        elems = malloc(sizeof(*elems));
+        elems[0] = strdup(v ? v->value : "");
+        var_set_array(name, elems, 1);
+        v = var_lookup(name);
     }
-    old_path = getenv("PWD");
-    res = chdir(path);
-    if(res == -1) {
-        fprintf(stderr, "%s: cd: %s: %s\n", SELF_NAME, path,
-                strerror(errno));
-        return;
+    if(i >= v->nelems) {
+        v->elems = realloc(v->elems, sizeof(*v->elems) * (i + 1));
+        for(; v->nelems <= i; v->nelems++)
+            v->elems[v->nelems] = strdup("");
+    }
+    free(v->elems[i]);
+    v->elems[i] = strdup(value);
+}
+
+void var_export(const char *name)
+{
+    struct var_item *v;
+    v = var_lookup(name);
+    if(!v)
+        v = var_set(name, "");
+    v->exported = 1;
+    setenv(name, v->value, 1);
+}
+
+void var_unset(const char *name)
+{
+    struct var_item **pv, *tmp;
+    for(pv = &vars[var_hash(name)]; *pv; pv = &(*pv)->next) {
+        if(0 == strcmp((*pv)->name, name)) {
+            tmp = *pv;
+            *pv = tmp->next;
+            var_free_elems(tmp);
+            free(tmp->name);
+            free(tmp->value);
+            free(tmp);
+            break;
+        }
+    }
+    unsetenv(name);
+}
+
+extern char **environ;
+
+void import_environ()
+{
+    char **env, *eq, *name;
+    for(env = environ; *env; env++) {
+        eq = strchr(*env, '=');
+        if(!eq)
+            continue;
+        name = strndup(*env, eq - *env);
+        var_set(name, eq + 1)->exported = 1;
+        free(name);
     }
-    setenv("OLDPWD", old_path, 1);
-    setenv("PWD", path, 1);
 }
 
-int str_to_int(const char *str, int *ok)
+int is_name_char(char c, int first)
+{
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (!first && c >= '0' && c <= '9');
+}
+
+int is_valid_name(const char *s)
+{
+    if(!is_name_char(*s, 1))
+        return 0;
+    for(s++; *s; s++)
+        if(!is_name_char(*s, 0))
+            return 0;
+    return 1;
+}
+
+/* parses a decimal integer; *ok is lowered if str is not a number or
+ * does not fit into 64 bits */
+long long str_to_int(const char *str, int *ok)
 {
-    int res = 0, sign = 0;
+    long long res = 0;
+    int sign = 0, valid;
     const char *p;
     if(*str == '-') {
         sign = 1;
@@ -268,504 +605,4002 @@ int str_to_int(const char *str, int *ok)
     } else {
         p = str;
     }
-    for(; *p; p++) {
+    valid = *p != '\0';
+    for(; *p && valid; p++) {
         if(*p < '0' || *p > '9') {
-            if(ok)
-                *ok = 0;
-            return 0;
+            valid = 0;
+            break;
         }
-        /* no checks for overflow */
-        res = res * 10 + *p - '0';
+        /* accumulate negated, so that the minimal value fits as well */
+        if(__builtin_mul_overflow(res, 10, &res) ||
+           __builtin_sub_overflow(res, *p - '0', &res))
+            valid = 0;
     }
+    if(valid && !sign && res == LLONG_MIN)
+        valid = 0;
     if(ok)
-        *ok = 1;
-    return sign ? -res : res;
+        *ok = valid;
+    if(!valid)
+        return 0;
+    return sign ? res : -res;
 }
 
-void exit_cmd(char **argv)
+struct positional {
+    int argc;       /* count of parameters, not including $0 */
+    char **argv;
+};
+
+struct positional pos_params = { 0, NULL };
+char *shell_name = SELF_NAME;
+
+/* Words are compiled into a list of parts when the command is parsed, so
+ * expanding them only means walking this list. */
+
+enum wpart_type { wp_lit, wp_param, wp_procsub, wp_arith, wp_cmdsub };
+
+struct word_part {
+    enum wpart_type type;
+    int quoted;
+    char *text;             /* literal text, parameter name, `<' or `>' */
+    struct node *sub;       /* commands of a process or command substitution */
+    struct arith *arith;    /* expression of `$((...))' */
+    struct word_part *next;
+};
+
+struct word {
+    struct word_part *parts;
+    char *lit;              /* final text if the word has no expansions */
+    struct word *next;
+};
+
+struct word_builder {
+    struct arena *arena;
+    struct word_part **tail;
+    struct dyn_str lit;
+    int lit_active, lit_quoted;
+};
+
+void wb_flush(struct word_builder *wb)
 {
-    /* there is a minor memory leak caused by this function
-     * (wlist and cmd are not being released)
-     * but it's not a big deal, because program finishes here anyway */
-    int code, len, ok;
-    code = 0;
-    len = len_argv(argv);
-    if(len > 2) {
-        fprintf(stderr, "%s: exit: too many arguments\n", SELF_NAME);
+    struct word_part *p;
+    if(!wb->lit_active)
         return;
-    } else if(len == 2) {
-        code = str_to_int(argv[1], &ok);
-        if(!ok) {
-            fprintf(stderr, "%s: exit: %s: numeric argument required\n",
-                    SELF_NAME, argv[1]);
+    p = arena_alloc(wb->arena, sizeof(*p));
+    p->type = wp_lit;
+    p->quoted = wb->lit_quoted;
+    p->text = arena_strndup(wb->arena, wb->lit.str, wb->lit.pos);
+    p->next = NULL;
+    *wb->tail = p;
+    wb->tail = &p->next;
+    wb->lit.pos = 0;
+    wb->lit_active = 0;
+}
+
+void wb_lit(struct word_builder *wb, char c, int quoted)
+{
+    if(wb->lit_active && wb->lit_quoted != quoted)
+        wb_flush(wb);
+    dstr_append(&wb->lit, c);
+    wb->lit_active = 1;
+    wb->lit_quoted = quoted;
+}
+
+/* makes sure that `""' and `''' give an empty field */
+void wb_empty_quotes(struct word_builder *wb)
+{
+    if(!wb->lit_active) {
+        wb->lit_active = 1;
+        wb->lit_quoted = 1;
+    }
+}
+
+struct word_part *wb_part(struct word_builder *wb, enum wpart_type type,
+                          char *text, int quoted)
+{
+    struct word_part *p;
+    /* a quoted expansion makes a field by itself if it has to, so `""'
+     * before it is dropped: "$@" gives no field without parameters */
+    if(quoted && wb->lit_active && wb->lit.pos == 0)
+        wb->lit_active = 0;
+    wb_flush(wb);
+    p = arena_alloc(wb->arena, sizeof(*p));
+    p->type = type;
+    p->quoted = quoted;
+    p->text = text;
+    p->sub = NULL;
+    p->arith = NULL;
+    p->next = NULL;
+    *wb->tail = p;
+    wb->tail = &p->next;
+    return p;
+}
+
+/* c points at `$'; returns pointer to the last character of the
+ * parameter reference or NULL if `$' is just a regular character */
+const char *scan_param(struct word_builder *wb, const char *c, int quoted)
+{
+    const char *start;
+    if(c[1] == '{') {
+        start = c + 2;
+        c = strchr(start, '}');
+        if(!c)
+            return NULL;
+        wb_part(wb, wp_param, arena_strndup(wb->arena, start, c - start),
+                quoted);
+        return c;
+    } else if(is_name_char(c[1], 1)) {
+        start = c + 1;
+        for(c = start; is_name_char(c[1], 0); c++)
+            {}
+    } else if((c[1] >= '0' && c[1] <= '9') || (c[1] && strchr("?$!#@*", c[1]))) {
+        start = c + 1;
+        c = start;
+    } else {
+        return NULL;
+    }
+    wb_part(wb, wp_param, arena_strndup(wb->arena, start, c - start + 1),
+            quoted);
+    return c;
+}
+
+struct word_item *tokenize_line(char *line, int *status);
+struct node *parse_program(struct word_item *wlist, struct arena *arena,
+                           int *status);
+
+/* compiles the text of `<(...)' and alike into the arena */
+struct node *compile_subprogram(struct arena *a, const char *text, int len)
+{
+    struct word_item *wlist;
+    struct node *prog = NULL;
+    char *buf;
+    int status;
+    buf = malloc(len + 2);
+    memcpy(buf, text, len);
+    buf[len] = '\n';
+    buf[len+1] = '\0';
+    wlist = tokenize_line(buf, &status);
+    if(status == code_succ)
+        prog = parse_program(wlist, a, &status);
+    if(status == code_incomplete || status == code_quot_msmtch)
+        fprintf(stderr, "Syntax error: unexpected end of `%.*s'\n", len, text);
+    wlist_free(wlist);
+    free(buf);
+    return status == code_succ ? prog : NULL;
+}
+
+/* c points at `<(' or `>('; returns pointer to the closing parenthesis or
+ * NULL if the commands inside have a syntax error */
+const char *compile_procsub(struct word_builder *wb, const char *c)
+{
+    struct word_part *p;
+    const char *end;
+    end = scan_parens((char *)c + 1);
+    p = wb_part(wb, wp_procsub, *c == '<' ? "<" : ">", 1);
+    p->sub = compile_subprogram(wb->arena, c + 2, end - c - 2);
+    return p->sub ? end : NULL;
+}
+
+struct arith *compile_arith(struct arena *a, const char *src, int len);
+
+/* c points at `$('; returns pointer to the closing parenthesis or NULL if
+ * the text inside has a syntax error */
+const char *compile_dollar_parens(struct word_builder *wb, const char *c,
+                                  int quoted)
+{
+    struct word_part *p;
+    const char *end;
+    end = scan_double_parens((char *)c + 1);
+    if(end) {
+        p = wb_part(wb, wp_arith, NULL, quoted);
+        p->arith = compile_arith(wb->arena, c + 3, end - c - 4);
+        return p->arith ? end : NULL;
+    }
+    end = scan_parens((char *)c + 1);
+    p = wb_part(wb, wp_cmdsub, NULL, quoted);
+    p->sub = compile_subprogram(wb->arena, c + 2, end - c - 2);
+    return p->sub ? end : NULL;
+}
+
+/* c points at a backquote; backslashes quoting `$', `\' and the backquote
+ * (and `"' inside double quotes) are removed before the commands are
+ * compiled */
+const char *compile_backquotes(struct word_builder *wb, const char *c,
+                               int quoted)
+{
+    struct word_part *p;
+    struct dyn_str text;
+    dstr_init(&text, word_init_size);
+    for(c++; *c != '`'; c++) {
+        if(*c == '\\' && (strchr("$`\\", c[1]) || (quoted && c[1] == '"')))
+            c++;
+        dstr_append(&text, *c);
+    }
+    p = wb_part(wb, wp_cmdsub, NULL, quoted);
+    p->sub = compile_subprogram(wb->arena, text.str, text.pos);
+    free(text.str);
+    return p->sub ? c : NULL;
+}
+
+/* returns NULL if the word contains a syntax error */
+struct word *compile_word(struct arena *a, const char *raw)
+{
+    struct word *w;
+    struct word_builder wb;
+    struct word_part *p;
+    const char *c, *end;
+    int in_dq = 0;
+    w = arena_alloc(a, sizeof(*w));
+    w->parts = NULL;
+    w->lit = NULL;
+    w->next = NULL;
+    wb.arena = a;
+    wb.tail = &w->parts;
+    wb.lit_active = 0;
+    wb.lit_quoted = 0;
+    dstr_init(&wb.lit, word_init_size);
+    for(c = raw; *c; c++) {
+        if(*c == '\'' && !in_dq) {
+            wb_empty_quotes(&wb);
+            for(c++; *c != '\''; c++)
+                wb_lit(&wb, *c, 1);
+        } else if(*c == '"') {
+            if(!in_dq)
+                wb_empty_quotes(&wb);
+            in_dq = !in_dq;
+        } else if(*c == '\\' && c[1]) {
+            c++;
+            if(!in_dq || strchr("$`\"\\\n", *c)) {
+                if(*c != '\n')
+                    wb_lit(&wb, *c, 1);
+            } else {
+                wb_lit(&wb, '\\', 1);
+                wb_lit(&wb, *c, 1);
+            }
+        } else if(*c == '$' && c[1] == '(') {
+            c = compile_dollar_parens(&wb, c, in_dq);
+            if(!c) {
+                free(wb.lit.str);
+                return NULL;
+            }
+        } else if(*c == '`') {
+            c = compile_backquotes(&wb, c, in_dq);
+            if(!c) {
+                free(wb.lit.str);
+                return NULL;
+            }
+        } else if(*c == '$' && (end = scan_param(&wb, c, in_dq))) {
+            c = end;
+        } else if(!in_dq && is_procsub_start(c)) {
+            c = compile_procsub(&wb, c);
+            if(!c) {
+                free(wb.lit.str);
+                return NULL;
+            }
+        } else {
+            wb_lit(&wb, *c, in_dq);
+        }
+    }
+    wb_flush(&wb);
+    free(wb.lit.str);
+    for(p = w->parts; p; p = p->next)
+        if(p->type != wp_lit)
+            return w;
+    if(w->parts && !w->parts->next) {
+        w->lit = w->parts->text;
+    } else {
+        struct dyn_str lit;
+        dstr_init(&lit, word_init_size);
+        for(p = w->parts; p; p = p->next)
+            dstr_append_str(&lit, p->text);
+        w->lit = arena_strndup(a, lit.str, lit.pos);
+        free(lit.str);
+    }
+    return w;
+}
+
+struct fields {
+    char **arr;
+    int size, capacity;
+};
+
+void fields_init(struct fields *f)
+{
+    f->arr = NULL;
+    f->size = 0;
+    f->capacity = 0;
+}
+
+void fields_append(struct fields *f, char *s)
+{
+    if(f->size == f->capacity) {
+        if(f->size == 0)
+            f->capacity = 4;
+        else
+            f->capacity *= 2;
+        f->arr = realloc(f->arr, sizeof(*f->arr) * f->capacity);
+    }
+    (f->arr)[f->size] = s;
+    (f->size)++;
+}
+
+/* NULL-terminates the fields, so they can be used as argv */
+char **fields_argv(struct fields *f)
+{
+    fields_append(f, NULL);
+    (f->size)--;
+    return f->arr;
+}
+
+void fields_free(struct fields *f)
+{
+    int i;
+    for(i = 0; i < f->size; i++)
+        free(f->arr[i]);
+    free(f->arr);
+}
+
+const char *param_value(const char *name)
+{
+    static char buf[24];
+    const char *value;
+    if(*name >= '0' && *name <= '9') {
+        int n = atoi(name);
+        if(n == 0)
+            return shell_name;
+        return n <= pos_params.argc ? pos_params.argv[n-1] : "";
+    }
+    switch(*name) {
+    case '?':
+        sprintf(buf, "%d", last_status);
+        return buf;
+    case '$':
+        sprintf(buf, "%d", shell_pid);
+        return buf;
+    case '!':
+        if(!last_bg_pid)
+            return "";
+        sprintf(buf, "%d", last_bg_pid);
+        return buf;
+    case '#':
+        sprintf(buf, "%d", pos_params.argc);
+        return buf;
+    }
+    value = var_get(name);
+    return value ? value : "";
+}
+
+int arith_eval_text(const char *text, long long *res);
+
+/* evaluates a subscript of an array reference; -1 if it is invalid */
+long long array_index(const char *sub)
+{
+    long long i;
+    if(arith_eval_text(sub, &i) == -1)
+        return -1;
+    return i;
+}
+
+const char *array_elem(struct var_item *v, long long i)
+{
+    if(!v || i < 0)
+        return NULL;
+    if(!v->elems)
+        return i == 0 ? v->value : NULL;
+    return i < v->nelems ? v->elems[i] : NULL;
+}
+
+/* Resolves the parameter reference.  References which expand to several
+ * words ($@, $*, ${name[@]}, ${name[*]}) store them to list and return
+ * `@' or `*'; others store the value and return 0. */
+int param_lookup(const char *name, const char **value, char ***list,
+                 int *count)
+{
+    static char buf[24];
+    struct var_item *v;
+    const char *br, *sub;
+    char *base;
+    int i, len;
+    if(0 == strcmp(name, "@") || 0 == strcmp(name, "*")) {
+        *list = pos_params.argv;
+        *count = pos_params.argc;
+        return *name;
+    }
+    br = strchr(name, '[');
+    if(!br) {
+        if(*name == '#' && name[1]) {
+            /* ${#name} */
+            sprintf(buf, "%d", (int)strlen(param_value(name + 1)));
+            *value = buf;
+        } else {
+            *value = param_value(name);
+        }
+        return 0;
+    }
+    len = *name == '#' ? br - name - 1 : br - name;
+    base = strndup(*name == '#' ? name + 1 : name, len);
+    v = var_lookup(base);
+    free(base);
+    sub = strndup(br + 1, strcspn(br + 1, "]"));
+    *list = v ? v->elems : NULL;
+    *count = v ? v->nelems : 0;
+    if(v && !v->elems) {
+        /* a scalar is an array of one element */
+        *list = &v->value;
+        *count = 1;
+    }
+    if(0 == strcmp(sub, "@") || 0 == strcmp(sub, "*")) {
+        i = *sub;
+        free((char *)sub);
+        if(*name != '#')
+            return i;
+        /* ${#name[@]} */
+        sprintf(buf, "%d", *count);
+        *value = buf;
+        return 0;
+    }
+    *value = array_elem(v, array_index(sub));
+    free((char *)sub);
+    if(!*value)
+        *value = "";
+    if(*name == '#') {
+        sprintf(buf, "%d", (int)strlen(*value));
+        *value = buf;
+    }
+    return 0;
+}
+
+const char *ifs_chars()
+{
+    const char *ifs = var_get("IFS");
+    return ifs ? ifs : " \t\n";
+}
+
+int is_ifs(char c, const char *ifs)
+{
+    return c && strchr(ifs, c);
+}
+
+void field_break(struct fields *f, struct dyn_str *field, int *has_field)
+{
+    if(!*has_field)
+        return;
+    fields_append(f, dstr_finish(field));
+    dstr_init(field, word_init_size);
+    *has_field = 0;
+}
+
+void field_add_value(struct fields *f, struct dyn_str *field,
+                     int *has_field, const char *value, int quoted)
+{
+    const char *ifs;
+    if(quoted) {
+        dstr_append_str(field, value);
+        *has_field = 1;
+        return;
+    }
+    ifs = ifs_chars();
+    for(; *value; value++) {
+        if(is_ifs(*value, ifs)) {
+            field_break(f, field, has_field);
+        } else {
+            dstr_append(field, *value);
+            *has_field = 1;
+        }
+    }
+}
+
+void expand_param(struct word_part *p, struct fields *f,
+                  struct dyn_str *field, int *has_field)
+{
+    const char *value;
+    char **list;
+    int i, count, form;
+    form = param_lookup(p->text, &value, &list, &count);
+    if(!form) {
+        field_add_value(f, field, has_field, value, p->quoted);
+        return;
+    }
+    if(p->quoted && form == '*')
+        *has_field = 1;     /* "$*" is a field even if it is empty */
+    for(i = 0; i < count; i++) {
+        if(i > 0 && p->quoted && form == '@') {
+            *has_field = 1;
+            field_break(f, field, has_field);
+        } else if(i > 0) {
+            field_add_value(f, field, has_field, " ", p->quoted);
+        }
+        field_add_value(f, field, has_field, list[i], p->quoted);
+    }
+}
+
+const char *start_procsub(struct word_part *p);
+char *run_cmdsub(struct node *sub);
+int arith_run(struct arith *a, long long *res);
+
+int expand_failed = 0;  /* raised if an expansion has failed */
+
+const char *arith_value(struct arith *a)
+{
+    static char buf[24];
+    long long res;
+    if(arith_run(a, &res) == -1) {
+        expand_failed = 1;
+        return "";
+    }
+    sprintf(buf, "%lld", res);
+    return buf;
+}
+
+/* expands the word and splits the result into fields */
+void expand_word(struct word *w, struct fields *f)
+{
+    struct word_part *p;
+    struct dyn_str field;
+    char *out;
+    int has_field = 0;
+    if(w->lit) {
+        fields_append(f, strdup(w->lit));
+        return;
+    }
+    dstr_init(&field, word_init_size);
+    for(p = w->parts; p; p = p->next) {
+        switch(p->type) {
+        case wp_lit:
+            dstr_append_str(&field, p->text);
+            has_field = 1;
+            break;
+        case wp_param:
+            expand_param(p, f, &field, &has_field);
+            break;
+        case wp_procsub:
+            field_add_value(f, &field, &has_field, start_procsub(p), 1);
+            break;
+        case wp_arith:
+            field_add_value(f, &field, &has_field, arith_value(p->arith),
+                            p->quoted);
+            break;
+        case wp_cmdsub:
+            out = run_cmdsub(p->sub);
+            field_add_value(f, &field, &has_field, out, p->quoted);
+            free(out);
+            break;
+        }
+    }
+    if(has_field)
+        fields_append(f, dstr_finish(&field));
+    else
+        free(field.str);
+}
+
+void expand_words(struct word *w, struct fields *f)
+{
+    for(; w; w = w->next)
+        expand_word(w, f);
+}
+
+void append_pattern_text(struct dyn_str *d, const char *text, int escape)
+{
+    for(; *text; text++) {
+        if(escape && strchr("*?[]\\", *text))
+            dstr_append(d, '\\');
+        dstr_append(d, *text);
+    }
+}
+
+/* expands the word without field splitting; if as_pattern is raised,
+ * quoted characters are escaped for fnmatch(3) */
+char *expand_word_str(struct word *w, int as_pattern)
+{
+    struct word_part *p;
+    struct dyn_str res;
+    const char *value;
+    char **list, *out;
+    int i, count;
+    if(w->lit && !as_pattern)
+        return strdup(w->lit);
+    dstr_init(&res, word_init_size);
+    for(p = w->parts; p; p = p->next) {
+        int escape = as_pattern && p->quoted;
+        if(p->type == wp_lit) {
+            append_pattern_text(&res, p->text, escape);
+        } else if(p->type == wp_procsub) {
+            append_pattern_text(&res, start_procsub(p), escape);
+        } else if(p->type == wp_arith) {
+            append_pattern_text(&res, arith_value(p->arith), escape);
+        } else if(p->type == wp_cmdsub) {
+            out = run_cmdsub(p->sub);
+            append_pattern_text(&res, out, escape);
+            free(out);
+        } else if(param_lookup(p->text, &value, &list, &count)) {
+            for(i = 0; i < count; i++) {
+                if(i > 0)
+                    dstr_append(&res, ' ');
+                append_pattern_text(&res, list[i], escape);
+            }
+        } else {
+            append_pattern_text(&res, value, escape);
+        }
+    }
+    return dstr_finish(&res);
+}
+
+/* Arithmetic expansion.  Expressions are parsed by precedence climbing
+ * into a tree of 64-bit integer operations.  An expression with no `$' in
+ * it is parsed together with the command; otherwise it is parsed when it
+ * is expanded, and the tree is kept until the expanded text changes. */
+
+enum arith_op {
+    ar_num, ar_var, ar_neg, ar_pos, ar_not, ar_bnot, ar_preinc, ar_predec,
+    ar_postinc, ar_postdec, ar_pow, ar_mul, ar_div, ar_mod, ar_add, ar_sub,
+    ar_shl, ar_shr, ar_lt, ar_le, ar_gt, ar_ge, ar_eq, ar_ne, ar_band,
+    ar_bxor, ar_bor, ar_and, ar_or, ar_cond, ar_assign, ar_comma
+};
+
+struct arith_node {
+    enum arith_op op;
+    enum arith_op assign_op;    /* ar_assign for `=', or the binary op */
+    long long value;
+    char *name;
+    struct arith_node *left, *right, *third;  /* left is index of ar_var */
+};
+
+struct arith {
+    char *src;                  /* text of the expression */
+    struct word *word;          /* compiled src, if it has expansions */
+    struct arith_node *expr;
+    const char *error;          /* error of parsing expr */
+    char *cached_src;           /* expanded text expr was parsed from */
+    struct arena *cache;
+};
+
+struct arith_binop {
+    const char *tok;
+    enum arith_op op;
+    int prec;
+};
+
+/* longer tokens go first */
+struct arith_binop arith_binops[] = {
+    { "**", ar_pow, 11 }, { "<<", ar_shl, 8 }, { ">>", ar_shr, 8 },
+    { "<=", ar_le, 7 },   { ">=", ar_ge, 7 },  { "==", ar_eq, 6 },
+    { "!=", ar_ne, 6 },   { "&&", ar_and, 2 }, { "||", ar_or, 1 },
+    { "*", ar_mul, 10 },  { "/", ar_div, 10 }, { "%", ar_mod, 10 },
+    { "+", ar_add, 9 },   { "-", ar_sub, 9 },  { "<", ar_lt, 7 },
+    { ">", ar_gt, 7 },    { "&", ar_band, 5 }, { "^", ar_bxor, 4 },
+    { "|", ar_bor, 3 },
+};
+
+struct arith_parser {
+    const char *c;
+    struct arena *arena;
+    const char *error;
+};
+
+void arith_skip_spaces(struct arith_parser *ap)
+{
+    while(is_whitespace(*ap->c) || *ap->c == '\n')
+        ap->c++;
+}
+
+int arith_at(struct arith_parser *ap, const char *tok)
+{
+    arith_skip_spaces(ap);
+    return 0 == strncmp(ap->c, tok, strlen(tok));
+}
+
+struct arith_node *arith_node_new(struct arith_parser *ap, enum arith_op op,
+                                  struct arith_node *left,
+                                  struct arith_node *right)
+{
+    struct arith_node *n;
+    n = arena_alloc(ap->arena, sizeof(*n));
+    memset(n, 0, sizeof(*n));
+    n->op = op;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+struct arith_node *arith_fail(struct arith_parser *ap, const char *error)
+{
+    if(!ap->error)
+        ap->error = error;
+    return NULL;
+}
+
+int arith_parse_number(const char *s, int len, long long *res)
+{
+    unsigned long long v = 0;
+    int base = 10, i = 0, d;
+    if(len > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        base = 16;
+        i = 2;
+        if(len == 2)
+            return -1;
+    } else if(len > 1 && s[0] == '0') {
+        base = 8;
+        i = 1;
+    }
+    for(; i < len; i++) {
+        if(s[i] >= '0' && s[i] <= '9')
+            d = s[i] - '0';
+        else if(s[i] >= 'a' && s[i] <= 'f')
+            d = s[i] - 'a' + 10;
+        else if(s[i] >= 'A' && s[i] <= 'F')
+            d = s[i] - 'A' + 10;
+        else
+            return -1;
+        if(d >= base || v > (ULLONG_MAX - d) / base)
+            return -1;
+        v = v * base + d;
+    }
+    if(v > LLONG_MAX)
+        return -1;
+    *res = v;
+    return 0;
+}
+
+struct arith_node *arith_parse_comma(struct arith_parser *ap);
+struct arith_node *arith_parse_assign(struct arith_parser *ap);
+struct arith_node *arith_parse_unary(struct arith_parser *ap);
+
+struct arith_node *arith_parse_primary(struct arith_parser *ap)
+{
+    struct arith_node *n;
+    const char *start;
+    arith_skip_spaces(ap);
+    start = ap->c;
+    if(*ap->c == '(') {
+        ap->c++;
+        n = arith_parse_comma(ap);
+        if(!n)
+            return NULL;
+        if(!arith_at(ap, ")"))
+            return arith_fail(ap, "missing `)'");
+        ap->c++;
+        return n;
+    }
+    if(*ap->c >= '0' && *ap->c <= '9') {
+        while(is_name_char(*ap->c, 0))
+            ap->c++;
+        n = arith_node_new(ap, ar_num, NULL, NULL);
+        if(arith_parse_number(start, ap->c - start, &n->value) == -1)
+            return arith_fail(ap, "invalid number");
+        return n;
+    }
+    if(*ap->c == '$' && is_name_char(ap->c[1], 1))
+        start = ++ap->c;
+    if(!is_name_char(*ap->c, 1))
+        return arith_fail(ap, *ap->c ? "syntax error: operand expected" :
+                          "syntax error: unexpected end of expression");
+    while(is_name_char(*ap->c, 0))
+        ap->c++;
+    n = arith_node_new(ap, ar_var, NULL, NULL);
+    n->name = arena_strndup(ap->arena, start, ap->c - start);
+    if(*ap->c == '[') {
+        ap->c++;
+        n->left = arith_parse_comma(ap);
+        if(!n->left)
+            return NULL;
+        if(!arith_at(ap, "]"))
+            return arith_fail(ap, "missing `]'");
+        ap->c++;
+    }
+    return n;
+}
+
+struct arith_node *arith_parse_unary(struct arith_parser *ap)
+{
+    static const struct { const char *tok; enum arith_op op; } unops[] = {
+        { "++", ar_preinc }, { "--", ar_predec }, { "-", ar_neg },
+        { "+", ar_pos }, { "!", ar_not }, { "~", ar_bnot },
+    };
+    struct arith_node *n;
+    int i;
+    for(i = 0; i < sizeof(unops) / sizeof(*unops); i++) {
+        if(arith_at(ap, unops[i].tok)) {
+            ap->c += strlen(unops[i].tok);
+            n = arith_parse_unary(ap);
+            if(!n)
+                return NULL;
+            if((unops[i].op == ar_preinc || unops[i].op == ar_predec) &&
+               n->op != ar_var)
+                return arith_fail(ap, "`++' or `--' needs a variable");
+            return arith_node_new(ap, unops[i].op, n, NULL);
+        }
+    }
+    n = arith_parse_primary(ap);
+    if(n && n->op == ar_var &&
+       (arith_at(ap, "++") || arith_at(ap, "--"))) {
+        n = arith_node_new(ap, *ap->c == '+' ? ar_postinc : ar_postdec,
+                           n, NULL);
+        ap->c += 2;
+    }
+    return n;
+}
+
+struct arith_binop *arith_peek_binop(struct arith_parser *ap)
+{
+    int i, len;
+    arith_skip_spaces(ap);
+    for(i = 0; i < sizeof(arith_binops) / sizeof(*arith_binops); i++) {
+        len = strlen(arith_binops[i].tok);
+        if(0 != strncmp(ap->c, arith_binops[i].tok, len))
+            continue;
+        /* `*=', `<<=' and alike are assignments */
+        if(ap->c[len] == '=' && arith_binops[i].op != ar_le &&
+           arith_binops[i].op != ar_ge && arith_binops[i].op != ar_eq &&
+           arith_binops[i].op != ar_ne)
+            return NULL;
+        return &arith_binops[i];
+    }
+    return NULL;
+}
+
+struct arith_node *arith_parse_binary(struct arith_parser *ap, int min_prec)
+{
+    struct arith_node *left, *right;
+    struct arith_binop *op;
+    left = arith_parse_unary(ap);
+    while(left && (op = arith_peek_binop(ap)) && op->prec >= min_prec) {
+        ap->c += strlen(op->tok);
+        /* `**' is right associative */
+        right = arith_parse_binary(ap, op->op == ar_pow ? op->prec :
+                                   op->prec + 1);
+        if(!right)
+            return NULL;
+        left = arith_node_new(ap, op->op, left, right);
+    }
+    return left;
+}
+
+struct arith_node *arith_parse_cond(struct arith_parser *ap)
+{
+    struct arith_node *n, *cond;
+    cond = arith_parse_binary(ap, 1);
+    if(!cond || !arith_at(ap, "?"))
+        return cond;
+    ap->c++;
+    n = arith_node_new(ap, ar_cond, cond, arith_parse_comma(ap));
+    if(!n->right)
+        return NULL;
+    if(!arith_at(ap, ":"))
+        return arith_fail(ap, "`:' expected for conditional expression");
+    ap->c++;
+    n->third = arith_parse_cond(ap);
+    return n->third ? n : NULL;
+}
+
+struct arith_node *arith_parse_assign(struct arith_parser *ap)
+{
+    static const struct { const char *tok; enum arith_op op; } asops[] = {
+        { "<<=", ar_shl }, { ">>=", ar_shr }, { "*=", ar_mul },
+        { "/=", ar_div }, { "%=", ar_mod }, { "+=", ar_add },
+        { "-=", ar_sub }, { "&=", ar_band }, { "^=", ar_bxor },
+        { "|=", ar_bor }, { "=", ar_assign },
+    };
+    struct arith_node *n, *target;
+    int i;
+    target = arith_parse_cond(ap);
+    if(!target)
+        return NULL;
+    for(i = 0; i < sizeof(asops) / sizeof(*asops); i++)
+        if(arith_at(ap, asops[i].tok) && !arith_at(ap, "=="))
+            break;
+    if(i == sizeof(asops) / sizeof(*asops))
+        return target;
+    if(target->op != ar_var)
+        return arith_fail(ap, "attempted assignment to non-variable");
+    ap->c += strlen(asops[i].tok);
+    n = arith_node_new(ap, ar_assign, target, arith_parse_assign(ap));
+    n->assign_op = asops[i].op;
+    return n->right ? n : NULL;
+}
+
+struct arith_node *arith_parse_comma(struct arith_parser *ap)
+{
+    struct arith_node *n;
+    n = arith_parse_assign(ap);
+    while(n && arith_at(ap, ",")) {
+        ap->c++;
+        n = arith_node_new(ap, ar_comma, n, arith_parse_assign(ap));
+        if(!n->right)
+            return NULL;
+    }
+    return n;
+}
+
+/* parses the whole text; returns NULL and sets *error on failure */
+struct arith_node *arith_parse(struct arena *a, const char *text,
+                               const char **error)
+{
+    struct arith_parser ap;
+    struct arith_node *n;
+    ap.c = text;
+    ap.arena = a;
+    ap.error = NULL;
+    arith_skip_spaces(&ap);
+    if(!*ap.c) {
+        /* empty expression is 0 */
+        n = arith_node_new(&ap, ar_num, NULL, NULL);
+        n->value = 0;
+        return n;
+    }
+    n = arith_parse_comma(&ap);
+    arith_skip_spaces(&ap);
+    if(n && *ap.c)
+        n = arith_fail(&ap, "syntax error in expression");
+    *error = ap.error;
+    return n;
+}
+
+const char *arith_error;
+
+int arith_eval(struct arith_node *n, long long *res);
+int arith_eval_value(const char *text, long long *res);
+
+/* evaluates the subscript of an array element; 0 for a plain variable */
+int arith_index(struct arith_node *n, long long *i)
+{
+    *i = 0;
+    return n->left ? arith_eval(n->left, i) : 0;
+}
+
+int arith_get_var(struct arith_node *n, long long i, long long *res)
+{
+    static int depth = 0;
+    const char *value;
+    int ok, status;
+    value = n->left ? array_elem(var_lookup(n->name), i) : var_get(n->name);
+    if(!value || !*value) {
+        *res = 0;
+        return 0;
+    }
+    *res = str_to_int(value, &ok);
+    if(ok || arith_parse_number(value, strlen(value), res) == 0)
+        return 0;
+    /* the value is an expression itself */
+    if(depth >= 64) {
+        arith_error = "expression recursion level exceeded";
+        return -1;
+    }
+    depth++;
+    status = arith_eval_value(value, res);
+    depth--;
+    return status;
+}
+
+int arith_set_var(struct arith_node *n, long long i, long long value)
+{
+    char buf[24];
+    sprintf(buf, "%lld", value);
+    if(!n->left) {
+        var_set(n->name, buf);
+        return 0;
+    }
+    /* arrays are not sparse, so the index is limited */
+    if(i < 0 || i >= array_max_size) {
+        arith_error = "bad array subscript";
+        return -1;
+    }
+    var_set_elem(n->name, i, buf);
+    return 0;
+}
+
+/* applies a binary operator, checking for overflows */
+int arith_binary(enum arith_op op, long long a, long long b, long long *res)
+{
+    switch(op) {
+    case ar_add:
+        if(__builtin_add_overflow(a, b, res))
+            break;
+        return 0;
+    case ar_sub:
+        if(__builtin_sub_overflow(a, b, res))
+            break;
+        return 0;
+    case ar_mul:
+        if(__builtin_mul_overflow(a, b, res))
+            break;
+        return 0;
+    case ar_div:
+    case ar_mod:
+        if(b == 0) {
+            arith_error = "division by 0";
+            return -1;
+        }
+        if(a == LLONG_MIN && b == -1)
+            break;
+        *res = op == ar_div ? a / b : a % b;
+        return 0;
+    case ar_pow:
+        if(b < 0) {
+            arith_error = "exponent less than 0";
+            return -1;
+        }
+        /* by squaring; a square overflowing while bits of b are left
+         * means the result overflows too */
+        for(*res = 1; b > 0; b >>= 1) {
+            if((b & 1) && __builtin_mul_overflow(*res, a, res))
+                goto overflow;
+            if(b > 1 && __builtin_mul_overflow(a, a, &a))
+                goto overflow;
+        }
+        return 0;
+    case ar_shl:
+        *res = (long long)((unsigned long long)a << (b & 63));
+        return 0;
+    case ar_shr:
+        *res = a >> (b & 63);
+        return 0;
+    case ar_lt:   *res = a < b;  return 0;
+    case ar_le:   *res = a <= b; return 0;
+    case ar_gt:   *res = a > b;  return 0;
+    case ar_ge:   *res = a >= b; return 0;
+    case ar_eq:   *res = a == b; return 0;
+    case ar_ne:   *res = a != b; return 0;
+    case ar_band: *res = a & b;  return 0;
+    case ar_bxor: *res = a ^ b;  return 0;
+    case ar_bor:  *res = a | b;  return 0;
+    default:
+        arith_error = "unknown operator";
+        return -1;
+    }
+overflow:
+    arith_error = "integer overflow";
+    return -1;
+}
+
+int arith_eval(struct arith_node *n, long long *res)
+{
+    long long a, b, i;
+    switch(n->op) {
+    case ar_num:
+        *res = n->value;
+        return 0;
+    case ar_var:
+        if(arith_index(n, &i) == -1)
+            return -1;
+        return arith_get_var(n, i, res);
+    case ar_neg:
+    case ar_pos:
+    case ar_not:
+    case ar_bnot:
+        if(arith_eval(n->left, &a) == -1)
+            return -1;
+        if(n->op == ar_neg)
+            return arith_binary(ar_sub, 0, a, res);
+        *res = n->op == ar_pos ? a : n->op == ar_not ? !a : ~a;
+        return 0;
+    case ar_preinc:
+    case ar_predec:
+    case ar_postinc:
+    case ar_postdec:
+        if(arith_index(n->left, &i) == -1 ||
+           arith_get_var(n->left, i, &a) == -1)
+            return -1;
+        if(arith_binary(n->op == ar_preinc || n->op == ar_postinc ?
+                        ar_add : ar_sub, a, 1, &b) == -1)
+            return -1;
+        *res = n->op == ar_preinc || n->op == ar_predec ? b : a;
+        return arith_set_var(n->left, i, b);
+    case ar_and:
+    case ar_or:
+        /* short-circuit evaluation */
+        if(arith_eval(n->left, &a) == -1)
+            return -1;
+        if((n->op == ar_and) == !a) {
+            *res = !!a;
+            return 0;
+        }
+        if(arith_eval(n->right, &b) == -1)
+            return -1;
+        *res = !!b;
+        return 0;
+    case ar_cond:
+        if(arith_eval(n->left, &a) == -1)
+            return -1;
+        return arith_eval(a ? n->right : n->third, res);
+    case ar_assign:
+        if(arith_eval(n->right, &b) == -1 ||
+           arith_index(n->left, &i) == -1)
+            return -1;
+        if(n->assign_op != ar_assign) {
+            if(arith_get_var(n->left, i, &a) == -1 ||
+               arith_binary(n->assign_op, a, b, &b) == -1)
+                return -1;
+        }
+        *res = b;
+        return arith_set_var(n->left, i, b);
+    case ar_comma:
+        if(arith_eval(n->left, &a) == -1)
+            return -1;
+        return arith_eval(n->right, res);
+    default:
+        if(arith_eval(n->left, &a) == -1 || arith_eval(n->right, &b) == -1)
+            return -1;
+        return arith_binary(n->op, a, b, res);
+    }
+}
+
+void arith_drop_cache(void *arg)
+{
+    struct arith *a = arg;
+    free(a->cached_src);
+    if(a->cache)
+        arena_release(a->cache);
+}
+
+struct arith *compile_arith(struct arena *a, const char *src, int len)
+{
+    struct arith *ar;
+    ar = arena_alloc(a, sizeof(*ar));
+    memset(ar, 0, sizeof(*ar));
+    ar->src = arena_strndup(a, src, len);
+    if(!strpbrk(ar->src, "$`")) {
+        ar->expr = arith_parse(a, ar->src, &ar->error);
+        return ar;
+    }
+    ar->word = compile_word(a, ar->src);
+    if(!ar->word)
+        return NULL;
+    arena_on_release(a, arith_drop_cache, ar);
+    return ar;
+}
+
+/* evaluates the expression, printing a message on error */
+int arith_run(struct arith *a, long long *res)
+{
+    char *text;
+    if(a->word) {
+        text = expand_word_str(a->word, 0);
+        if(!a->cached_src || 0 != strcmp(text, a->cached_src)) {
+            arith_drop_cache(a);
+            a->cache = arena_new();
+            a->cached_src = text;
+            a->expr = arith_parse(a->cache, text, &a->error);
+        } else {
+            free(text);
+        }
+    }
+    if(!a->expr) {
+        fprintf(stderr, "%s: %s: %s\n", SELF_NAME, a->src, a->error);
+        return -1;
+    }
+    if(arith_eval(a->expr, res) == -1) {
+        fprintf(stderr, "%s: %s: %s\n", SELF_NAME, a->src, arith_error);
+        return -1;
+    }
+    return 0;
+}
+
+/* evaluates the value of a variable as an expression, quietly */
+int arith_eval_value(const char *text, long long *res)
+{
+    struct arena *arena;
+    struct arith_node *expr;
+    int status = -1;
+    arena = arena_new();
+    expr = arith_parse(arena, text, &arith_error);
+    if(expr)
+        status = arith_eval(expr, res);
+    arena_release(arena);
+    return status;
+}
+
+/* evaluates an expression which is not going to be evaluated again */
+int arith_eval_text(const char *text, long long *res)
+{
+    struct arith a;
+    struct arena *arena;
+    int status;
+    arena = arena_new();
+    memset(&a, 0, sizeof(a));
+    a.src = (char *)text;
+    a.expr = arith_parse(arena, text, &a.error);
+    status = arith_run(&a, res);
+    arena_release(arena);
+    return status;
+}
+
+enum node_type {
+    node_cmd, node_pipeline, node_and, node_or, node_subshell, node_group,
+    node_if, node_while, node_until, node_for, node_case, node_func,
+    node_arith, node_arith_for, node_fanout
+};
+
+struct redir {
+    int fd;                 /* 0 for `<', 1 for `>' and `>>' */
+    int append_f;           /* raised for `>>' */
+    struct word *target;
+    struct redir *next;
+};
+
+struct assign {
+    char *name;
+    struct word *value;
+    struct assign *next;
+};
+
+struct case_item {
+    struct word *patterns;
+    struct node *body;
+    struct case_item *next;
+};
+
+struct node {
+    enum node_type type;
+    int run_in_bg;          /* raised if is a background job */
+    int negate;             /* raised if preceded by `!' */
+    struct word *words;     /* argv of a command, list of a for loop */
+    struct assign *assigns; /* NAME=value prefixes of a command */
+    struct redir *redirs;
+    char *name;             /* loop variable or function name */
+    struct node *left, *right;          /* operands of `&&' and `||' */
+    struct node *cond, *body, *else_part;
+    struct node **cmds;     /* members of a pipeline or a fan-out */
+    int size;               /* count of `cmds' */
+    struct case_item *items;
+    struct arena *arena;    /* arena holding a function body */
+    struct arith *arith[3]; /* `((expr))', or init, test and step of `for' */
+    struct node *next;      /* next command of a list */
+};
+
+struct parser {
+    struct word_item *cur;
+    struct arena *arena;
+    int status;
+};
+
+struct node *new_node(struct parser *p, enum node_type type)
+{
+    struct node *n;
+    n = arena_alloc(p->arena, sizeof(*n));
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    return n;
+}
+
+int at_delim(struct parser *p, const char *d)
+{
+    return p->cur && p->cur->t_type == token_delimiter &&
+           0 == strcmp(p->cur->word, d);
+}
+
+int at_keyword(struct parser *p, const char *kw)
+{
+    return p->cur && p->cur->t_type == token_word &&
+           0 == strcmp(p->cur->word, kw);
+}
+
+int at_word(struct parser *p)
+{
+    return p->cur && p->cur->t_type == token_word;
+}
+
+void advance(struct parser *p)
+{
+    p->cur = p->cur->next;
+}
+
+void skip_newlines(struct parser *p)
+{
+    while(at_delim(p, "\n"))
+        advance(p);
+}
+
+void syntax_error(struct parser *p)
+{
+    if(p->status != code_succ)
+        return;
+    if(!p->cur) {
+        /* the command continues on the next line */
+        p->status = code_incomplete;
+        return;
+    }
+    fprintf(stderr, "Syntax error near unexpected token `%s'\n",
+            *p->cur->word == '\n' ? "newline" : p->cur->word);
+    p->status = code_syntax_err;
+}
+
+int expect_keyword(struct parser *p, const char *kw)
+{
+    if(!at_keyword(p, kw)) {
+        syntax_error(p);
+        return -1;
+    }
+    advance(p);
+    return 0;
+}
+
+int expect_delim(struct parser *p, const char *d)
+{
+    if(!at_delim(p, d)) {
+        syntax_error(p);
+        return -1;
+    }
+    advance(p);
+    return 0;
+}
+
+int at_list_end(struct parser *p)
+{
+    static const char *const terms[] = {
+        "then", "else", "elif", "fi", "do", "done", "esac", "}", NULL
+    };
+    int i;
+    if(!p->cur)
+        return 1;
+    if(at_delim(p, ")") || at_delim(p, ";;"))
+        return 1;
+    for(i = 0; terms[i]; i++)
+        if(at_keyword(p, terms[i]))
+            return 1;
+    return 0;
+}
+
+int is_redirect_token(struct parser *p)
+{
+    return at_delim(p, "<") || at_delim(p, ">") || at_delim(p, ">>");
+}
+
+int is_assignment(const char *word)
+{
+    const char *c;
+    if(!is_name_char(*word, 1))
+        return 0;
+    for(c = word + 1; is_name_char(*c, 0); c++)
+        {}
+    return *c == '=';
+}
+
+struct node *parse_list(struct parser *p);
+struct node *parse_command(struct parser *p);
+
+/* compiles the current token and advances */
+struct word *parse_word(struct parser *p, const char *raw)
+{
+    struct word *w;
+    w = compile_word(p->arena, raw);
+    if(!w)
+        p->status = code_syntax_err;
+    advance(p);
+    return w;
+}
+
+int parse_redirect(struct parser *p, struct redir ***tail)
+{
+    struct redir *r;
+    char *tok = p->cur->word;
+    if(!p->cur->next || p->cur->next->t_type != token_word) {
+        fprintf(stderr, "File name expected after `%s'\n", tok);
+        p->status = code_syntax_err;
+        return -1;
+    }
+    r = arena_alloc(p->arena, sizeof(*r));
+    r->fd = *tok == '<' ? 0 : 1;
+    r->append_f = tok[1] == '>';
+    advance(p);
+    r->target = parse_word(p, p->cur->word);
+    if(!r->target)
+        return -1;
+    r->next = NULL;
+    **tail = r;
+    *tail = &r->next;
+    return 0;
+}
+
+int parse_redirects(struct parser *p, struct redir **redirs)
+{
+    struct redir **tail = redirs;
+    while(is_redirect_token(p))
+        if(parse_redirect(p, &tail) == -1)
+            return -1;
+    return 0;
+}
+
+struct node *parse_simple_command(struct parser *p)
+{
+    struct node *n;
+    struct word **wtail;
+    struct assign **atail;
+    struct redir **rtail;
+    n = new_node(p, node_cmd);
+    wtail = &n->words;
+    atail = &n->assigns;
+    rtail = &n->redirs;
+    while(p->cur) {
+        if(at_word(p) && !n->words && is_assignment(p->cur->word)) {
+            struct assign *a;
+            char *eq = strchr(p->cur->word, '=');
+            a = arena_alloc(p->arena, sizeof(*a));
+            a->name = arena_strndup(p->arena, p->cur->word,
+                                    eq - p->cur->word);
+            a->value = parse_word(p, eq + 1);
+            if(!a->value)
+                return NULL;
+            a->next = NULL;
+            *atail = a;
+            atail = &a->next;
+        } else if(at_word(p)) {
+            *wtail = parse_word(p, p->cur->word);
+            if(!*wtail)
+                return NULL;
+            wtail = &(*wtail)->next;
+        } else if(is_redirect_token(p)) {
+            if(parse_redirect(p, &rtail) == -1)
+                return NULL;
+        } else {
+            break;
+        }
+    }
+    if(!n->words && !n->assigns && !n->redirs) {
+        syntax_error(p);
+        return NULL;
+    }
+    return n;
+}
+
+/* parses a list which must contain at least one command */
+struct node *parse_body(struct parser *p)
+{
+    struct node *n;
+    n = parse_list(p);
+    if(!n)
+        syntax_error(p);
+    return n;
+}
+
+struct node *parse_if(struct parser *p)
+{
+    struct node *n;
+    n = new_node(p, node_if);
+    advance(p);  /* `if' or `elif' */
+    n->cond = parse_body(p);
+    if(!n->cond || expect_keyword(p, "then") == -1)
+        return NULL;
+    n->body = parse_body(p);
+    if(!n->body)
+        return NULL;
+    if(at_keyword(p, "elif")) {
+        n->else_part = parse_if(p);
+        return n->else_part ? n : NULL;
+    }
+    if(at_keyword(p, "else")) {
+        advance(p);
+        n->else_part = parse_body(p);
+        if(!n->else_part)
+            return NULL;
+    }
+    return expect_keyword(p, "fi") == -1 ? NULL : n;
+}
+
+int parse_do_group(struct parser *p, struct node *n)
+{
+    if(expect_keyword(p, "do") == -1)
+        return -1;
+    n->body = parse_body(p);
+    if(!n->body)
+        return -1;
+    return expect_keyword(p, "done");
+}
+
+struct node *parse_while(struct parser *p)
+{
+    struct node *n;
+    n = new_node(p, at_keyword(p, "while") ? node_while : node_until);
+    advance(p);
+    n->cond = parse_body(p);
+    if(!n->cond || parse_do_group(p, n) == -1)
+        return NULL;
+    return n;
+}
+
+int at_arith(struct parser *p)
+{
+    char *end;
+    if(!at_word(p))
+        return 0;
+    end = scan_double_parens(p->cur->word);
+    return end && !end[1];
+}
+
+/* compiles the current `((expr))' word into n->arith starting from idx;
+ * for the arithmetic `for' the expression is split at top-level `;' */
+int parse_arith(struct parser *p, struct node *n, int idx, int count)
+{
+    const char *c, *start;
+    int depth = 0;
+    start = c = p->cur->word + 2;
+    for(; *c; c++) {
+        if(*c == '(') {
+            depth++;
+        } else if(*c == ')' && depth-- == 0) {
+            break;
+        } else if(*c == ';' && depth == 0 && idx < count - 1) {
+            n->arith[idx++] = compile_arith(p->arena, start, c - start);
+            if(!n->arith[idx-1])
+                break;
+            start = c + 1;
+        }
+    }
+    if(idx == count - 1 && *c == ')')
+        n->arith[idx++] = compile_arith(p->arena, start, c - start);
+    if(idx != count || !n->arith[idx-1]) {
+        syntax_error(p);
+        return -1;
+    }
+    advance(p);
+    return 0;
+}
+
+struct node *parse_arith_command(struct parser *p)
+{
+    struct node *n;
+    n = new_node(p, node_arith);
+    return parse_arith(p, n, 0, 1) == -1 ? NULL : n;
+}
+
+struct node *parse_arith_for(struct parser *p)
+{
+    struct node *n;
+    n = new_node(p, node_arith_for);
+    if(parse_arith(p, n, 0, 3) == -1)
+        return NULL;
+    if(!n->arith[1]->src[strspn(n->arith[1]->src, " \t\n")])
+        n->arith[1] = NULL;     /* empty test is always true */
+    if(at_delim(p, ";"))
+        advance(p);
+    skip_newlines(p);
+    return parse_do_group(p, n) == -1 ? NULL : n;
+}
+
+struct node *parse_for(struct parser *p)
+{
+    struct node *n;
+    struct word **tail;
+    advance(p);
+    if(at_arith(p))
+        return parse_arith_for(p);
+    n = new_node(p, node_for);
+    if(!at_word(p) || !is_valid_name(p->cur->word)) {
+        syntax_error(p);
+        return NULL;
+    }
+    n->name = arena_strndup(p->arena, p->cur->word, strlen(p->cur->word));
+    advance(p);
+    skip_newlines(p);
+    if(at_keyword(p, "in")) {
+        advance(p);
+        for(tail = &n->words; at_word(p); tail = &(*tail)->next) {
+            *tail = parse_word(p, p->cur->word);
+            if(!*tail)
+                return NULL;
+        }
+        if(!at_delim(p, ";") && !at_delim(p, "\n")) {
+            syntax_error(p);
+            return NULL;
+        }
+        advance(p);
+    } else {
+        /* `for name' iterates over the positional parameters */
+        n->words = compile_word(p->arena, "\"$@\"");
+        if(at_delim(p, ";"))
+            advance(p);
+    }
+    skip_newlines(p);
+    return parse_do_group(p, n) == -1 ? NULL : n;
+}
+
+struct node *parse_case(struct parser *p)
+{
+    struct node *n;
+    struct case_item *item, **tail;
+    struct word **ptail;
+    n = new_node(p, node_case);
+    advance(p);
+    if(!at_word(p)) {
+        syntax_error(p);
+        return NULL;
+    }
+    n->words = parse_word(p, p->cur->word);
+    if(!n->words)
+        return NULL;
+    skip_newlines(p);
+    if(expect_keyword(p, "in") == -1)
+        return NULL;
+    skip_newlines(p);
+    tail = &n->items;
+    while(!at_keyword(p, "esac")) {
+        if(at_delim(p, "("))
+            advance(p);
+        item = arena_alloc(p->arena, sizeof(*item));
+        item->patterns = NULL;
+        item->next = NULL;
+        ptail = &item->patterns;
+        for(;;) {
+            if(!at_word(p)) {
+                syntax_error(p);
+                return NULL;
+            }
+            *ptail = parse_word(p, p->cur->word);
+            if(!*ptail)
+                return NULL;
+            ptail = &(*ptail)->next;
+            if(!at_delim(p, "|"))
+                break;
+            advance(p);
+        }
+        if(expect_delim(p, ")") == -1)
+            return NULL;
+        item->body = parse_list(p);
+        if(p->status != code_succ)
+            return NULL;
+        *tail = item;
+        tail = &item->next;
+        if(at_delim(p, ";;")) {
+            advance(p);
+        } else if(!at_keyword(p, "esac")) {
+            syntax_error(p);
+            return NULL;
+        }
+        skip_newlines(p);
+    }
+    advance(p);
+    return n;
+}
+
+struct node *parse_group(struct parser *p, enum node_type type)
+{
+    struct node *n;
+    n = new_node(p, type);
+    advance(p);  /* `{' or `(' */
+    n->body = parse_body(p);
+    if(!n->body)
+        return NULL;
+    if(type == node_group)
+        return expect_keyword(p, "}") == -1 ? NULL : n;
+    return expect_delim(p, ")") == -1 ? NULL : n;
+}
+
+struct node *parse_funcdef(struct parser *p)
+{
+    struct node *n;
+    if(!is_valid_name(p->cur->word)) {
+        syntax_error(p);
+        return NULL;
+    }
+    n = new_node(p, node_func);
+    n->name = arena_strndup(p->arena, p->cur->word, strlen(p->cur->word));
+    n->arena = p->arena;
+    advance(p);  /* name */
+    advance(p);  /* `(' */
+    advance(p);  /* `)' */
+    skip_newlines(p);
+    if(!p->cur || (at_word(p) && !at_keyword(p, "{") &&
+       !at_keyword(p, "if") && !at_keyword(p, "while") &&
+       !at_keyword(p, "until") && !at_keyword(p, "for") &&
+       !at_keyword(p, "case"))) {
+        syntax_error(p);
+        return NULL;
+    }
+    n->body = parse_command(p);
+    if(!n->body)
+        return NULL;
+    if(n->body->type == node_cmd || n->body->type == node_func) {
+        fprintf(stderr, "Syntax error in definition of function `%s'\n",
+                n->name);
+        p->status = code_syntax_err;
+        return NULL;
+    }
+    return n;
+}
+
+int is_funcdef(struct parser *p)
+{
+    struct word_item *next;
+    if(!at_word(p))
+        return 0;
+    next = p->cur->next;
+    return next && next->t_type == token_delimiter &&
+           0 == strcmp(next->word, "(") && next->next &&
+           next->next->t_type == token_delimiter &&
+           0 == strcmp(next->next->word, ")");
+}
+
+struct node *parse_command(struct parser *p)
+{
+    struct node *n;
+    if(!p->cur) {
+        syntax_error(p);
+        return NULL;
+    }
+    if(at_delim(p, "("))
+        n = parse_group(p, node_subshell);
+    else if(at_keyword(p, "{"))
+        n = parse_group(p, node_group);
+    else if(at_keyword(p, "if"))
+        n = parse_if(p);
+    else if(at_keyword(p, "while") || at_keyword(p, "until"))
+        n = parse_while(p);
+    else if(at_keyword(p, "for"))
+        n = parse_for(p);
+    else if(at_keyword(p, "case"))
+        n = parse_case(p);
+    else if(at_arith(p))
+        n = parse_arith_command(p);
+    else if(is_funcdef(p))
+        return parse_funcdef(p);
+    else
+        return parse_simple_command(p);
+    if(!n || parse_redirects(p, &n->redirs) == -1)
+        return NULL;
+    return n;
+}
+
+struct node *parse_pipeline(struct parser *p)
+{
+    struct node *n, *cmd, *first, **tail;
+    int negate = 0, i;
+    if(at_keyword(p, "!")) {
+        negate = 1;
+        advance(p);
+    }
+    cmd = parse_command(p);
+    if(!cmd)
+        return NULL;
+    if(!at_delim(p, "|")) {
+        cmd->negate = negate;
+        return cmd;
+    }
+    n = new_node(p, node_pipeline);
+    n->negate = negate;
+    first = cmd;
+    tail = &cmd->next;
+    n->size = 1;
+    while(at_delim(p, "|")) {
+        advance(p);
+        skip_newlines(p);
+        cmd = parse_command(p);
+        if(!cmd)
+            return NULL;
+        *tail = cmd;
+        tail = &cmd->next;
+        n->size++;
+    }
+    n->cmds = arena_alloc(p->arena, sizeof(*n->cmds) * n->size);
+    for(i = 0, cmd = first; cmd; i++, cmd = cmd->next)
+        n->cmds[i] = cmd;
+    for(i = 0; i < n->size; i++)
+        n->cmds[i]->next = NULL;
+    return n;
+}
+
+/* `producer |+ consumer |+ ...' */
+struct node *parse_fanout(struct parser *p)
+{
+    struct node *n, *cmd, *first, **tail;
+    int i;
+    cmd = parse_pipeline(p);
+    if(!cmd || !at_delim(p, "|+"))
+        return cmd;
+    n = new_node(p, node_fanout);
+    n->negate = cmd->negate;
+    cmd->negate = 0;
+    first = cmd;
+    tail = &cmd->next;
+    n->size = 1;
+    while(at_delim(p, "|+")) {
+        advance(p);
+        skip_newlines(p);
+        cmd = parse_pipeline(p);
+        if(!cmd)
+            return NULL;
+        *tail = cmd;
+        tail = &cmd->next;
+        n->size++;
+    }
+    n->cmds = arena_alloc(p->arena, sizeof(*n->cmds) * n->size);
+    for(i = 0, cmd = first; cmd; i++, cmd = cmd->next)
+        n->cmds[i] = cmd;
+    for(i = 0; i < n->size; i++)
+        n->cmds[i]->next = NULL;
+    return n;
+}
+
+struct node *parse_and_or(struct parser *p)
+{
+    struct node *left, *n;
+    left = parse_fanout(p);
+    while(left && (at_delim(p, "&&") || at_delim(p, "||"))) {
+        n = new_node(p, at_delim(p, "&&") ? node_and : node_or);
+        advance(p);
+        skip_newlines(p);
+        n->left = left;
+        n->right = parse_fanout(p);
+        if(!n->right)
+            return NULL;
+        left = n;
+    }
+    return left;
+}
+
+struct node *parse_list(struct parser *p)
+{
+    struct node *first = NULL, **tail = &first, *n;
+    for(;;) {
+        skip_newlines(p);
+        if(at_list_end(p))
+            break;
+        n = parse_and_or(p);
+        if(!n)
+            return NULL;
+        if(at_delim(p, "&")) {
+            n->run_in_bg = 1;
+            advance(p);
+        } else if(at_delim(p, ";") || at_delim(p, "\n")) {
+            advance(p);
+        } else if(!at_list_end(p)) {
+            syntax_error(p);
+            return NULL;
+        }
+        *tail = n;
+        tail = &n->next;
+    }
+    return first;
+}
+
+struct node *parse_program(struct word_item *wlist, struct arena *arena,
+                           int *status)
+{
+    struct parser p;
+    struct node *prog;
+    p.cur = wlist;
+    p.arena = arena;
+    p.status = code_succ;
+    prog = parse_list(&p);
+    if(p.status == code_succ && p.cur)
+        syntax_error(&p);
+    *status = p.status;
+    return p.status == code_succ ? prog : NULL;
+}
+
+struct func_item {
+    char *name;
+    struct node *body;
+    struct arena *arena;
+    struct func_item *next;
+};
+
+struct func_item *functions = NULL;
+
+struct func_item *func_lookup(const char *name)
+{
+    struct func_item *f;
+    for(f = functions; f; f = f->next)
+        if(0 == strcmp(f->name, name))
+            return f;
+    return NULL;
+}
+
+void func_define(const char *name, struct node *body, struct arena *arena)
+{
+    struct func_item *f;
+    f = func_lookup(name);
+    if(f) {
+        arena_release(f->arena);
+    } else {
+        f = malloc(sizeof(*f));
+        f->name = strdup(name);
+        f->next = functions;
+        functions = f;
+    }
+    f->body = body;
+    f->arena = arena;
+    arena->refs++;
+}
+
+int loop_depth = 0;     /* count of loops being executed */
+int func_depth = 0;     /* count of functions being executed */
+int break_cnt = 0;      /* loops left to break out of */
+int continue_cnt = 0;   /* loops left to continue */
+int return_f = 0;       /* raised by `return' */
+/* raised by ^C in the interactive shell or in its foreground job; the
+ * command line being executed is abandoned */
+volatile sig_atomic_t interrupted = 0;
+
+int jump_pending()
+{
+    return break_cnt || continue_cnt || return_f || interrupted;
+}
+
+/* Builtins read bio.in_fd and write to out_file() rather than to the
+ * standard streams, so they can run on a thread of a pipeline or write
+ * into a command substitution buffer.  out_fd is -1 if the output is a
+ * memory stream. */
+struct builtin_io {
+    int in_fd, out_fd;
+    FILE *out;              /* NULL for stdout */
+    int in_thread;
+};
+
+__thread struct builtin_io bio = { 0, 1, NULL, 0 };
+
+FILE *out_file()
+{
+    return bio.out ? bio.out : stdout;
+}
+
+int len_argv(char **argv)
+{
+    char **arg;
+    for(arg = argv; *arg; arg++)
+        {}
+    return arg - argv;
+}
+
+int cd(char **argv)
+{
+    int res, len;
+    const char *path;
+    char *old_path;
+    len = len_argv(argv);
+    if(len > 2) {
+        fprintf(stderr, "%s: cd: too many arguments\n", SELF_NAME);
+        return 1;
+    } else if(len == 2) {
+        if(0 == strcmp(argv[1], "-")) {
+            path = var_get("OLDPWD");
+            if(!path) {
+                fprintf(stderr, "%s: cd: OLDPWD not set\n", SELF_NAME);
+                return 1;
+            }
+        } else {
+            path = argv[1];
+        }
+    } else {
+        path = var_get("HOME");
+        if(!path) {
+            fprintf(stderr, "%s: cd: HOME not set\n", SELF_NAME);
+            return 1;
+        }
+    }
+    res = chdir(path);
+    if(res == -1) {
+        fprintf(stderr, "%s: cd: %s: %s\n", SELF_NAME, path,
+                strerror(errno));
+        return 1;
+    }
+    old_path = var_get("PWD") ? strdup(var_get("PWD")) : NULL;
+    var_set("PWD", path);
+    var_export("PWD");
+    if(old_path) {
+        var_set("OLDPWD", old_path);
+        var_export("OLDPWD");
+        free(old_path);
+    }
+    return 0;
+}
+
+int pwd_cmd(char **argv)
+{
+    char buf[PATH_MAX];
+    if(!getcwd(buf, sizeof(buf))) {
+        fprintf(stderr, "%s: pwd: %s\n", SELF_NAME, strerror(errno));
+        return 1;
+    }
+    fprintf(out_file(), "%s\n", buf);
+    return 0;
+}
+
+void sync_stdin();
+
+void shell_exit(int status)
+{
+    if(!in_subshell)
+        exit(status);
+    /* exit(3) would set the offset of the script file, shared with the
+     * parent shell, to the position of the child's copy of the stream */
+    fflush(stdout);
+    fflush(stderr);
+    sync_stdin();
+    _exit(status);
+}
+
+int exit_cmd(char **argv)
+{
+    /* there is a minor memory leak caused by this function
+     * (parse tree and argv are not being released)
+     * but it's not a big deal, because program finishes here anyway */
+    int code, len, ok;
+    code = last_status;
+    len = len_argv(argv);
+    if(len > 2) {
+        fprintf(stderr, "%s: exit: too many arguments\n", SELF_NAME);
+        return 1;
+    } else if(len == 2) {
+        code = str_to_int(argv[1], &ok);
+        if(!ok) {
+            fprintf(stderr, "%s: exit: %s: numeric argument required\n",
+                    SELF_NAME, argv[1]);
+            return 2;
+        }
+    }
+    shell_exit(code & 255);
+    return 0;
+}
+
+int true_cmd(char **argv)
+{
+    return 0;
+}
+
+int false_cmd(char **argv)
+{
+    return 1;
+}
+
+/* options other than -n, like -e, are left to the echo command */
+int echo_takes(char **argv)
+{
+    char **arg;
+    for(arg = argv + 1; *arg && (*arg)[0] == '-' && (*arg)[1]; arg++) {
+        if(strspn(*arg + 1, "neE") != strlen(*arg + 1))
+            break;
+        if(0 != strcmp(*arg, "-n"))
+            return 0;
+    }
+    return 1;
+}
+
+int echo_cmd(char **argv)
+{
+    int i, newline = 1;
+    char **arg = argv + 1;
+    FILE *out = out_file();
+    while(*arg && 0 == strcmp(*arg, "-n")) {
+        newline = 0;
+        arg++;
+    }
+    for(i = 0; arg[i]; i++) {
+        if(i > 0)
+            putc(' ', out);
+        fputs(arg[i], out);
+    }
+    if(newline)
+        putc('\n', out);
+    return 0;
+}
+
+int test_int(const char *s, long long *res)
+{
+    int ok;
+    *res = str_to_int(s, &ok);
+    if(!ok)
+        fprintf(stderr, "%s: test: %s: integer expression expected\n",
+                SELF_NAME, s);
+    return ok;
+}
+
+int test_is_unary(const char *op)
+{
+    return op[0] == '-' && op[1] && !op[2] && strchr("nzedfrwxs", op[1]);
+}
+
+const char *const test_int_ops[] = {
+    "-eq", "-ne", "-lt", "-le", "-gt", "-ge", NULL
+};
+
+int test_is_binary(const char *op)
+{
+    int i;
+    if(0 == strcmp(op, "=") || 0 == strcmp(op, "==") ||
+       0 == strcmp(op, "!="))
+        return 1;
+    for(i = 0; test_int_ops[i]; i++)
+        if(0 == strcmp(op, test_int_ops[i]))
+            return 1;
+    return 0;
+}
+
+/* returns 0 if true, 1 if false and 2 on error */
+int test_unary(const char *op, const char *arg)
+{
+    struct stat st;
+    if(0 == strcmp(op, "-n"))
+        return !*arg;
+    if(0 == strcmp(op, "-z"))
+        return !!*arg;
+    if(!test_is_unary(op)) {
+        fprintf(stderr, "%s: test: %s: unary operator expected\n",
+                SELF_NAME, op);
+        return 2;
+    }
+    switch(op[1]) {
+    case 'r':
+        return access(arg, R_OK) != 0;
+    case 'w':
+        return access(arg, W_OK) != 0;
+    case 'x':
+        return access(arg, X_OK) != 0;
+    }
+    if(stat(arg, &st) == -1)
+        return 1;
+    switch(op[1]) {
+    case 'd':
+        return !S_ISDIR(st.st_mode);
+    case 'f':
+        return !S_ISREG(st.st_mode);
+    case 's':
+        return st.st_size == 0;
+    }
+    return 0;
+}
+
+int test_binary(const char *l, const char *op, const char *r)
+{
+    int i;
+    long long a, b;
+    if(0 == strcmp(op, "=") || 0 == strcmp(op, "=="))
+        return strcmp(l, r) != 0;
+    if(0 == strcmp(op, "!="))
+        return strcmp(l, r) == 0;
+    for(i = 0; test_int_ops[i]; i++)
+        if(0 == strcmp(op, test_int_ops[i]))
+            break;
+    if(!test_int_ops[i]) {
+        fprintf(stderr, "%s: test: %s: binary operator expected\n",
+                SELF_NAME, op);
+        return 2;
+    }
+    if(!test_int(l, &a) || !test_int(r, &b))
+        return 2;
+    switch(i) {
+    case 0: return !(a == b);
+    case 1: return !(a != b);
+    case 2: return !(a < b);
+    case 3: return !(a <= b);
+    case 4: return !(a > b);
+    default: return !(a >= b);
+    }
+}
+
+/* finds the operands of `test' or `[', after the closing `]' is taken
+ * off and a leading `!' is stored to negate; returns their count, or -1
+ * if `]' is missing */
+int test_operands(char **argv, char ***arg, int *negate)
+{
+    int argc;
+    *arg = argv + 1;
+    *negate = 0;
+    argc = len_argv(argv) - 1;
+    if(0 == strcmp(argv[0], "[")) {
+        if(argc == 0 || 0 != strcmp(argv[argc], "]"))
+            return -1;
+        argc--;
+    }
+    if(argc > 1 && 0 == strcmp(**arg, "!")) {
+        *negate = 1;
+        (*arg)++;
+        argc--;
+    }
+    return argc;
+}
+
+/* -a, -o, parentheses and operators like -L or -nt are left to the test
+ * command */
+int test_takes(char **argv)
+{
+    char **arg;
+    int argc, negate;
+    argc = test_operands(argv, &arg, &negate);
+    if(argc == 2)
+        return test_is_unary(arg[0]);
+    if(argc == 3)
+        return test_is_binary(arg[1]);
+    return argc < 2;
+}
+
+int test_cmd(char **argv)
+{
+    int argc, negate, res;
+    char **arg;
+    argc = test_operands(argv, &arg, &negate);
+    if(argc == -1) {
+        fprintf(stderr, "%s: [: missing `]'\n", SELF_NAME);
+        return 2;
+    }
+    switch(argc) {
+    case 0:
+        res = 1;
+        break;
+    case 1:
+        res = !*arg[0];
+        break;
+    case 2:
+        res = test_unary(arg[0], arg[1]);
+        break;
+    case 3:
+        res = test_binary(arg[0], arg[1], arg[2]);
+        break;
+    default:
+        fprintf(stderr, "%s: test: too many arguments\n", SELF_NAME);
+        return 2;
+    }
+    return negate && res != 2 ? !res : res;
+}
+
+int loop_jump(char **argv, int *counter)
+{
+    long long n = 1;
+    int ok = 1;
+    if(argv[1])
+        n = str_to_int(argv[1], &ok);
+    if(!ok || n < 1) {
+        fprintf(stderr, "%s: %s: %s: loop count out of range\n",
+                SELF_NAME, argv[0], argv[1]);
+        return 1;
+    }
+    if(loop_depth == 0)
+        return 0;
+    *counter = n < loop_depth ? n : loop_depth;
+    return 0;
+}
+
+int break_cmd(char **argv)
+{
+    return loop_jump(argv, &break_cnt);
+}
+
+int continue_cmd(char **argv)
+{
+    return loop_jump(argv, &continue_cnt);
+}
+
+int return_cmd(char **argv)
+{
+    int code = last_status, ok;
+    if(func_depth == 0) {
+        fprintf(stderr, "%s: return: can only `return' from a function\n",
+                SELF_NAME);
+        return 1;
+    }
+    if(argv[1]) {
+        code = str_to_int(argv[1], &ok);
+        if(!ok) {
+            fprintf(stderr, "%s: return: %s: numeric argument required\n",
+                    SELF_NAME, argv[1]);
+            code = 2;
+        }
+    }
+    return_f = 1;
+    return code & 255;
+}
+
+int export_cmd(char **argv)
+{
+    int status = 0;
+    char **env, *eq, *name;
+    if(!argv[1]) {
+        for(env = environ; *env; env++)
+            printf("export %s\n", *env);
+        return 0;
+    }
+    for(argv++; *argv; argv++) {
+        eq = strchr(*argv, '=');
+        name = eq ? strndup(*argv, eq - *argv) : strdup(*argv);
+        if(!is_valid_name(name)) {
+            fprintf(stderr, "%s: export: `%s': not a valid identifier\n",
+                    SELF_NAME, *argv);
+            status = 1;
+        } else {
+            if(eq)
+                var_set(name, eq + 1);
+            var_export(name);
+        }
+        free(name);
+    }
+    return status;
+}
+
+int unset_cmd(char **argv)
+{
+    for(argv++; *argv; argv++)
+        var_unset(*argv);
+    return 0;
+}
+
+int shift_cmd(char **argv)
+{
+    long long n = 1;
+    int ok = 1;
+    if(argv[1])
+        n = str_to_int(argv[1], &ok);
+    if(!ok || n < 0) {
+        fprintf(stderr, "%s: shift: %s: numeric argument required\n",
+                SELF_NAME, argv[1]);
+        return 1;
+    }
+    if(n > pos_params.argc)
+        return 1;
+    pos_params.argc -= n;
+    pos_params.argv += n;
+    return 0;
+}
+
+/* Input of `read' and `mapfile'.  If stdin is seekable, it is read in big
+ * blocks and the unconsumed part is given back with lseek(2) before anyone
+ * else can see the file offset (forks, exec, redirections of stdin, exit).
+ * Otherwise bytes are read one by one, so no input meant for other
+ * commands is consumed. */
+
+struct in_buf {
+    char *data;
+    int pos, len;           /* unconsumed input is data[pos..len) */
+};
+
+struct in_buf stdin_buf = { NULL, 0, 0 };
+
+void sync_stdin()
+{
+    if(stdin_buf.pos < stdin_buf.len)
+        lseek(0, stdin_buf.pos - stdin_buf.len, SEEK_CUR);
+    stdin_buf.pos = 0;
+    stdin_buf.len = 0;
+}
+
+/* returns count of buffered bytes, 0 on EOF or -1 on error; if greedy is
+ * raised, the caller consumes all the input, so it can be read ahead even
+ * if stdin is not seekable */
+int stdin_fill(int greedy)
+{
+    int n, size;
+    if(stdin_buf.pos < stdin_buf.len)
+        return stdin_buf.len - stdin_buf.pos;
+    if(!stdin_buf.data)
+        stdin_buf.data = malloc(in_buf_size);
+    size = greedy || lseek(0, 0, SEEK_CUR) != -1 ? in_buf_size : 1;
+    /* ^C in the interactive shell stops the read */
+    do {
+        n = read(0, stdin_buf.data, size);
+    } while(n == -1 && errno == EINTR && !interrupted);
+    stdin_buf.pos = 0;
+    stdin_buf.len = n > 0 ? n : 0;
+    return n;
+}
+
+enum {
+    rec_error = -1,
+    rec_eof   = 0,
+    rec_delim = 1,          /* the record ends with the delimiter */
+    rec_limit = 2,          /* the record has reached the size limit */
+};
+
+/* appends bytes from stdin up to and including delim to rec; if limit is
+ * positive, at most limit bytes are read */
+int read_record(struct dyn_str *rec, int delim, int limit, int greedy)
+{
+    int n, count = 0;
+    char *start, *found;
+    for(;;) {
+        n = stdin_fill(greedy);
+        if(n <= 0)
+            return n == 0 ? rec_eof : rec_error;
+        start = stdin_buf.data + stdin_buf.pos;
+        if(limit > 0 && n > limit - count)
+            n = limit - count;
+        found = memchr(start, delim, n);
+        if(found)
+            n = found - start + 1;
+        dstr_append_mem(rec, start, n);
+        stdin_buf.pos += n;
+        count += n;
+        if(found)
+            return rec_delim;
+        if(limit > 0 && count >= limit)
+            return rec_limit;
+    }
+}
+
+/* parses options of `read' and `mapfile': flags are letters from
+ * flag_opts, options with an argument are letters from arg_opts;
+ * returns index of the first operand or -1 on error */
+int parse_builtin_opts(char **argv, const char *flag_opts,
+                       const char *arg_opts, int *flags, char **optargs)
+{
+    int i;
+    char *c;
+    for(i = 1; argv[i] && argv[i][0] == '-' && argv[i][1]; i++) {
+        if(0 == strcmp(argv[i], "--"))
+            return i + 1;
+        for(c = argv[i] + 1; *c; c++) {
+            if(strchr(flag_opts, *c)) {
+                flags[strchr(flag_opts, *c) - flag_opts] = 1;
+            } else if(strchr(arg_opts, *c)) {
+                char **arg = &optargs[strchr(arg_opts, *c) - arg_opts];
+                if(c[1]) {
+                    *arg = c + 1;
+                } else if(argv[i+1]) {
+                    *arg = argv[++i];
+                } else {
+                    fprintf(stderr, "%s: %s: -%c: option requires an "
+                            "argument\n", SELF_NAME, argv[0], *c);
+                    return -1;
+                }
+                break;
+            } else {
+                fprintf(stderr, "%s: %s: -%c: invalid option\n",
+                        SELF_NAME, argv[0], *c);
+                return -1;
+            }
+        }
+    }
+    return i;
+}
+
+int is_ifs_space(char c, const char *ifs)
+{
+    return is_whitespace(c) || c == '\n' ? is_ifs(c, ifs) : 0;
+}
+
+/* Splits the line read by `read' between the variables.  Unless raw is
+ * raised, backslash makes the next character a part of a field. */
+void read_assign(char **names, char *line, int raw)
+{
+    struct dyn_str field;
+    const char *ifs;
+    char *c = line;
+    int last, end_ws;
+    ifs = ifs_chars();
+    while(is_ifs_space(*c, ifs))
+        c++;
+    for(; *names; names++) {
+        last = !names[1];
+        dstr_init(&field, word_init_size);
+        end_ws = 0;  /* field length without trailing IFS whitespace */
+        for(; *c; c++) {
+            if(*c == '\\' && !raw && c[1]) {
+                c++;
+            } else if(!last && is_ifs(*c, ifs)) {
+                break;
+            } else if(is_ifs_space(*c, ifs)) {
+                dstr_append(&field, *c);
+                continue;
+            }
+            dstr_append(&field, *c);
+            end_ws = field.pos;
+        }
+        field.pos = end_ws;
+        var_set(*names, dstr_finish(&field));
+        free(field.str);
+        /* skip the field separator */
+        while(is_ifs_space(*c, ifs))
+            c++;
+        if(*c && is_ifs(*c, ifs)) {
+            c++;
+            while(is_ifs_space(*c, ifs))
+                c++;
+        }
+    }
+}
+
+int read_cmd(char **argv)
+{
+    struct dyn_str line;
+    int i, res, flags[1] = { 0 }, delim = '\n', limit = 0, ok;
+    char *optargs[2] = { NULL, NULL };  /* -d delim, -n nchars */
+    i = parse_builtin_opts(argv, "r", "dn", flags, optargs);
+    if(i == -1)
+        return 2;
+    if(optargs[0])
+        delim = (unsigned char)*optargs[0];
+    if(optargs[1]) {
+        long long n = str_to_int(optargs[1], &ok);
+        limit = n;
+        if(!ok || n < 0 || n > INT_MAX) {
+            fprintf(stderr, "%s: read: %s: invalid number\n", SELF_NAME,
+                    optargs[1]);
+            return 2;
+        }
+    }
+    dstr_init(&line, line_init_size);
+    for(;;) {
+        res = read_record(&line, delim, limit ? limit - line.pos : 0, 0);
+        if(res != rec_delim)
+            break;
+        line.pos--;  /* strip the delimiter */
+        /* backslash-newline is a line continuation unless -r is given */
+        if(flags[0] || delim != '\n' || line.pos == 0 ||
+           line.str[line.pos-1] != '\\')
+            break;
+        line.pos--;
+    }
+    if(res == rec_error && interrupted) {
+        free(line.str);
+        return 128 + SIGINT;
+    }
+    if(res == rec_error)
+        perror("read");
+    dstr_finish(&line);
+    if(argv[i]) {
+        read_assign(argv + i, line.str, flags[0]);
+    } else {
+        /* the whole line goes to REPLY without field splitting */
+        char *from, *to;
+        for(from = to = line.str; *from; from++, to++) {
+            if(*from == '\\' && !flags[0] && from[1])
+                from++;
+            *to = *from;
+        }
+        *to = '\0';
+        var_set("REPLY", line.str);
+    }
+    free(line.str);
+    return res == rec_delim || res == rec_limit ? 0 : 1;
+}
+
+int mapfile_cmd(char **argv)
+{
+    struct fields lines;
+    struct dyn_str rec;
+    int i, res, flags[1] = { 0 }, delim = '\n', count = 0, ok;
+    char *optargs[2] = { NULL, NULL };  /* -d delim, -n count */
+    i = parse_builtin_opts(argv, "t", "dn", flags, optargs);
+    if(i == -1)
+        return 2;
+    if(optargs[0])
+        delim = (unsigned char)*optargs[0];
+    if(optargs[1]) {
+        long long n = str_to_int(optargs[1], &ok);
+        count = n;
+        if(!ok || n < 0 || n > INT_MAX) {
+            fprintf(stderr, "%s: %s: %s: invalid line count\n", SELF_NAME,
+                    argv[0], optargs[1]);
+            return 2;
+        }
+    }
+    if(argv[i] && !is_valid_name(argv[i])) {
+        fprintf(stderr, "%s: %s: `%s': not a valid identifier\n",
+                SELF_NAME, argv[0], argv[i]);
+        return 2;
+    }
+    fields_init(&lines);
+    do {
+        dstr_init(&rec, line_init_size);
+        /* without a line count all the input is consumed, so it is safe
+         * to read ahead even from a pipe */
+        res = read_record(&rec, delim, 0, count == 0);
+        if(rec.pos == 0) {
+            free(rec.str);
+            break;
+        }
+        if(res == rec_delim && flags[0])
+            rec.pos--;
+        fields_append(&lines, dstr_finish(&rec));
+    } while(res == rec_delim && lines.size != count);
+    if(res == rec_error && interrupted) {
+        fields_free(&lines);
+        return 128 + SIGINT;
+    }
+    if(res == rec_error)
+        perror(argv[0]);
+    var_set_array(argv[i] ? argv[i] : "MAPFILE", lines.arr, lines.size);
+    return res == rec_error;
+}
+
+/* `cat' moves the data with the cheapest call both descriptors allow:
+ * copy_file_range(2) between regular files, sendfile(2) from a regular
+ * file and splice(2) to or from a pipe; the data gets to user space only
+ * if none of them works. */
+
+enum copy_method { copy_range, copy_sendfile, copy_splice, copy_rw };
+
+enum { copy_chunk = 1 << 30 };
+
+int write_all(int fd, const char *buf, long len)
+{
+    long n;
+    while(len > 0) {
+        n = write(fd, buf, len);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n == -1)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* returns count of bytes moved, 0 on EOF or -1 on error */
+long copy_step(enum copy_method m, int in_fd, int out_fd, char *buf)
+{
+    long n;
+    switch(m) {
+    case copy_range:
+        return copy_file_range(in_fd, NULL, out_fd, NULL, copy_chunk, 0);
+    case copy_sendfile:
+        return sendfile(out_fd, in_fd, NULL, copy_chunk);
+    case copy_splice:
+        return splice(in_fd, NULL, out_fd, NULL, copy_chunk, 0);
+    default:
+        n = read(in_fd, buf, in_buf_size);
+        return n > 0 && write_all(out_fd, buf, n) == -1 ? -1 : n;
+    }
+}
+
+/* copies in_fd to out_fd from their current offsets to the end */
+int copy_fd(int in_fd, int out_fd)
+{
+    struct stat in_st, out_st;
+    enum copy_method m = copy_rw;
+    char *buf = NULL;
+    long n, total = 0;
+    int has_pipe;
+    if(fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1)
+        return -1;
+    has_pipe = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+    if(S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode))
+        m = copy_range;
+    else if(S_ISREG(in_st.st_mode))
+        m = copy_sendfile;
+    /* splice(2) with a terminal may hold the data back until the other
+     * end is closed, and the terminal copies it anyway */
+    else if(has_pipe && !isatty(in_fd) && !isatty(out_fd))
+        m = copy_splice;
+    for(;;) {
+        if(m == copy_rw && !buf)
+            buf = malloc(in_buf_size);
+        n = copy_step(m, in_fd, out_fd, buf);
+        if(n == -1 && errno == EINTR)
+            continue;
+        /* the descriptors may not support the call after all (a file
+         * system without copy_file_range, splice to a file opened for
+         * appending and alike); try a more general one */
+        if(n == -1 && total == 0 && m != copy_rw &&
+           (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+            errno == EOPNOTSUPP || errno == EBADF)) {
+            if(m == copy_range)
+                m = copy_sendfile;
+            else if(m == copy_sendfile && has_pipe)
+                m = copy_splice;
+            else
+                m = copy_rw;
+            continue;
+        }
+        if(n <= 0)
+            break;
+        total += n;
+    }
+    free(buf);
+    return n == -1 ? -1 : 0;
+}
+
+/* writes to the output of the builtin, which may be a memory stream */
+int cat_write(const char *buf, long len)
+{
+    if(bio.out_fd != -1)
+        return write_all(bio.out_fd, buf, len);
+    return fwrite(buf, 1, len, bio.out) == len ? 0 : -1;
+}
+
+int cat_fd(int fd)
+{
+    char *buf;
+    long n;
+    if(bio.out_fd != -1)
+        return copy_fd(fd, bio.out_fd);
+    buf = malloc(in_buf_size);
+    while((n = read(fd, buf, in_buf_size)) > 0 || (n == -1 && errno == EINTR))
+        if(n > 0 && cat_write(buf, n) == -1)
+            break;
+    free(buf);
+    return n == 0 ? 0 : -1;
+}
+
+/* options are left to the cat command */
+int cat_takes(char **argv)
+{
+    int i;
+    for(i = 1; argv[i]; i++)
+        if(argv[i][0] == '-' && argv[i][1])
+            return 0;
+    return 1;
+}
+
+int cat_cmd(char **argv)
+{
+    void (*old_handler)(int) = SIG_DFL;
+    int i, fd, err, status = 0;
+    char **files, *stdin_only[] = { "-", NULL };
+    files = argv[1] ? argv + 1 : stdin_only;
+    fflush(out_file());
+    /* a closed reader must not kill the shell itself; threads have
+     * SIGPIPE blocked instead */
+    if(!in_subshell && !bio.in_thread)
+        old_handler = signal(SIGPIPE, SIG_IGN);
+    for(i = 0; files[i]; i++) {
+        if(0 == strcmp(files[i], "-")) {
+            fd = bio.in_fd;
+            /* pass the input read ahead by `read' or `mapfile' first */
+            if(fd == 0 && stdin_buf.pos < stdin_buf.len &&
+               cat_write(stdin_buf.data + stdin_buf.pos,
+                         stdin_buf.len - stdin_buf.pos) == -1) {
+                perror("cat: write error");
+                status = 1;
+                break;
+            }
+            if(fd == 0)
+                stdin_buf.pos = stdin_buf.len = 0;
+        } else {
+            fd = open(files[i], O_RDONLY | O_CLOEXEC);
+            if(fd == -1) {
+                fprintf(stderr, "%s: cat: %s: %s\n", SELF_NAME, files[i],
+                        strerror(errno));
+                status = 1;
+                continue;
+            }
+        }
+        err = cat_fd(fd) == -1 ? errno : 0;
+        if(err && err != EPIPE) {
+            fprintf(stderr, "%s: cat: %s: %s\n", SELF_NAME, files[i],
+                    strerror(err));
+            status = 1;
+        }
+        if(fd != bio.in_fd)
+            close(fd);
+        if(err == EPIPE) {
+            status = 1;
+            break;
+        }
+    }
+    if(!in_subshell && !bio.in_thread)
+        signal(SIGPIPE, old_handler);
+    return status;
+}
+
+struct builtin {
+    const char *name;
+    int (*fn)(char **argv);
+    int in_place;   /* does not change the shell state, so it may run
+                       without a fork in a substitution or a pipeline */
+    int (*takes)(char **argv);  /* NULL, or whether the builtin handles the
+                                   arguments instead of the command of the
+                                   same name */
+    int own_job;    /* may block on the terminal for long, so it is forked
+                       into a job of its own under job control */
+};
+
+struct builtin builtins[] = {
+    { "cd",       cd,           0 },
+    { "pwd",      pwd_cmd,      1 },
+    { "exit",     exit_cmd,     0 },
+    { ":",        true_cmd,     1 },
+    { "true",     true_cmd,     1 },
+    { "false",    false_cmd,    1 },
+    { "echo",     echo_cmd,     1, echo_takes },
+    { "test",     test_cmd,     1, test_takes },
+    { "[",        test_cmd,     1, test_takes },
+    { "break",    break_cmd,    0 },
+    { "continue", continue_cmd, 0 },
+    { "return",   return_cmd,   0 },
+    { "export",   export_cmd,   0 },
+    { "unset",    unset_cmd,    0 },
+    { "shift",    shift_cmd,    0 },
+    { "read",     read_cmd,     0 },
+    { "mapfile",  mapfile_cmd,  0 },
+    { "readarray", mapfile_cmd, 0 },
+    { "cat",      cat_cmd,      1, cat_takes, 1 },
+    /* more builtin commands to come... */
+};
+
+struct builtin *find_builtin(const char *cmd)
+{
+    int blen, i;
+    blen = sizeof(builtins) / sizeof(*builtins);
+    for(i = 0; i < blen; i++)
+        if(0 == strcmp(builtins[i].name, cmd))
+            return &builtins[i];
+    return NULL;
+}
+
+/* returns the builtin which runs argv or NULL if an external command
+ * must run it */
+struct builtin *builtin_for(char **argv)
+{
+    struct builtin *b;
+    b = find_builtin(argv[0]);
+    if(b && b->takes && !b->takes(argv))
+        return NULL;
+    return b;
+}
+
+int run_builtin(char **argv)
+{
+    int status;
+    status = find_builtin(argv[0])->fn(argv);
+    fflush(out_file());
+    return status;
+}
+
+/* opens the file for reading if stdfd is 0, for writing otherwise */
+int open_redirect(int stdfd, const char *fname, int append_f)
+{
+    int fd, flags;
+    if(stdfd == 0) {
+        flags = O_RDONLY;
+    } else {
+        flags = O_WRONLY | O_CREAT;
+        flags |= append_f ? O_APPEND : O_TRUNC;
+    }
+    fd = open(fname, flags | O_CLOEXEC, 0666);
+    if(fd == -1)
+        perror(fname);
+    return fd;
+}
+
+int redirect_stdio_stream(int stdfd, const char *fname, int *fdcopy_ptr,
+                          int append_f)
+{
+    int fd;
+    fd = open_redirect(stdfd, fname, append_f);
+    if(fd == -1)
+        return -1;
+    if(stdfd == 0)
+        sync_stdin();
+    if(fdcopy_ptr) {
+        *fdcopy_ptr = fcntl(stdfd, F_DUPFD_CLOEXEC, 10);
+        if(*fdcopy_ptr == -1) {
+            perror("dup");
+            close(fd);
+            return -1;
+        }
+    }
+    if(dup2(fd, stdfd) == -1) {
+        perror("dup2");
+        if(fdcopy_ptr)
+            *fdcopy_ptr = -1;
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* applies redirections of a command; if fdcopies is not NULL, original
+ * standard streams are saved there to be restored by restore_streams */
+int redirect_streams(struct redir *r, int *fdcopies)
+{
+    struct fields f;
+    int res;
+    for(; r; r = r->next) {
+        fields_init(&f);
+        expand_word(r->target, &f);
+        if(f.size != 1) {
+            fprintf(stderr, "%s: ambiguous redirect\n", SELF_NAME);
+            fields_free(&f);
+            return -1;
+        }
+        if(r->fd == 1)
+            fflush(stdout);
+        res = redirect_stdio_stream(r->fd, f.arr[0],
+                                    fdcopies && fdcopies[r->fd] == -1 ?
+                                    &fdcopies[r->fd] : NULL,
+                                    r->append_f);
+        fields_free(&f);
+        if(res == -1)
+            return -1;
+    }
+    return 0;
+}
+
+void restore_streams(int *fdcopies)
+{
+    int fd;
+    for(fd = 0; fd < 2; fd++) {
+        if(fdcopies[fd] == -1)
+            continue;
+        if(fd == 0)
+            sync_stdin();
+        if(fd == 1)
+            fflush(stdout);
+        dup2(fdcopies[fd], fd);
+        close(fdcopies[fd]);
+        fdcopies[fd] = -1;
+    }
+}
+
+void remove_zombies(int s)
+{
+    int p;
+    signal(SIGCHLD, remove_zombies);
+    do {
+        p = wait4(-1, NULL, WNOHANG, NULL);
+    } while(p > 0);
+}
+
+int job_control()
+{
+    return session_tty_fd != -1 && !in_subshell;
+}
+
+/* forks the shell; in the child, the shell continues as a subshell
+ * which does not do any job control */
+int fork_subshell()
+{
+    int pid;
+    fflush(NULL);
+    sync_stdin();
+    pid = fork();
+    if(pid == 0) {
+        in_subshell = 1;
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+    }
+    return pid;
+}
+
+int wait_fg_process(int pid)
+{
+    int status;
+    while(waitpid(pid, &status, 0) == -1)
+        if(errno != EINTR)
+            return 1;
+    if(WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if(WIFSIGNALED(status)) {
+        if(WTERMSIG(status) == SIGINT && job_control())
+            interrupted = 1;
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+int exec_node(struct node *n);
+int exec_list(struct node *n);
+
+/* Process substitutions started while expanding the current command;
+ * the shell keeps its end of the pipe open until the command is done. */
+
+struct procsub {
+    int fd, pid;
+};
+
+struct procsub *procsubs = NULL;
+int procsub_cnt = 0, procsub_cap = 0;
+
+const char *start_procsub(struct word_part *p)
+{
+    static char path[32];
+    int fds[2], pid, i, outer_reads;
+    outer_reads = *p->text == '<';
+    if(pipe(fds) == -1) {
+        perror("pipe");
+        return "";
+    }
+    pid = fork_subshell();
+    if(pid == -1) {
+        perror(SELF_NAME);
+        close(fds[0]);
+        close(fds[1]);
+        return "";
+    } else if(pid == 0) {
+        /* do not hold pipes of other substitutions open */
+        for(i = 0; i < procsub_cnt; i++)
+            close(procsubs[i].fd);
+        dup2(outer_reads ? fds[1] : fds[0], outer_reads ? 1 : 0);
+        close(fds[0]);
+        close(fds[1]);
+        shell_exit(exec_list(p->sub));
+    }
+    close(outer_reads ? fds[1] : fds[0]);
+    if(procsub_cnt == procsub_cap) {
+        procsub_cap = procsub_cap ? procsub_cap * 2 : 4;
+        procsubs = realloc(procsubs, sizeof(*procsubs) * procsub_cap);
+    }
+    procsubs[procsub_cnt].fd = outer_reads ? fds[0] : fds[1];
+    procsubs[procsub_cnt].pid = pid;
+    procsub_cnt++;
+    sprintf(path, "/dev/fd/%d", outer_reads ? fds[0] : fds[1]);
+    return path;
+}
+
+/* closes pipes of substitutions started after the mark and waits for
+ * their processes: `>(cmd)' gets EOF, `<(cmd)' gets SIGPIPE if unread */
+void reap_procsubs(int mark)
+{
+    int i;
+    for(i = mark; i < procsub_cnt; i++)
+        close(procsubs[i].fd);
+    for(i = mark; i < procsub_cnt; i++)
+        wait_fg_process(procsubs[i].pid);
+    procsub_cnt = mark;
+}
+
+/* Command substitution.  A single call of a builtin which does not change
+ * the shell state writes to a memory stream; anything else runs in a
+ * subshell and its output is read from a pipe. */
+
+int cmdsub_status = 0;  /* status of the last command substitution */
+
+/* returns 1 if expanding the word has no side effects, so it does not
+ * matter where and how many times it is expanded */
+int word_is_pure(struct word *w)
+{
+    struct word_part *p;
+    if(w->lit)
+        return 1;
+    for(p = w->parts; p; p = p->next) {
+        /* array subscripts are arithmetic, which may assign */
+        if(p->type != wp_lit && (p->type != wp_param || strchr(p->text, '[')))
+            return 0;
+    }
+    return 1;
+}
+
+int words_are_pure(struct word *w)
+{
+    for(; w; w = w->next)
+        if(!word_is_pure(w))
+            return 0;
+    return 1;
+}
+
+/* returns the output of n or NULL if n can not be run in place */
+char *cmdsub_in_place(struct node *n)
+{
+    struct builtin *b;
+    struct builtin_io saved;
+    struct fields f;
+    char *out = NULL;
+    size_t size = 0;
+    int failed = expand_failed;
+    if(n->type != node_cmd || n->next || n->run_in_bg || n->assigns ||
+       n->redirs || !n->words || !n->words->lit)
+        return NULL;
+    b = find_builtin(n->words->lit);
+    if(!b || !b->in_place || func_lookup(n->words->lit))
+        return NULL;
+    /* a builtin which may read the terminal is forked, so ^C kills it
+     * rather than interrupting the shell */
+    if(b->own_job && job_control())
+        return NULL;
+    /* a substitution must not change the shell state, and its words
+     * are expanded again if the external command runs them */
+    if(!words_are_pure(n->words))
+        return NULL;
+    fields_init(&f);
+    expand_failed = 0;
+    expand_words(n->words, &f);
+    if(!expand_failed && b->takes && !b->takes(fields_argv(&f))) {
+        expand_failed = failed;
+        fields_free(&f);
+        return NULL;
+    }
+    if(expand_failed) {
+        cmdsub_status = 1;
+    } else {
+        saved = bio;
+        bio.out = open_memstream(&out, &size);
+        bio.out_fd = -1;
+        cmdsub_status = b->fn(fields_argv(&f));
+        fclose(bio.out);
+        bio = saved;
+        if(n->negate)
+            cmdsub_status = !cmdsub_status;
+    }
+    expand_failed = failed;
+    fields_free(&f);
+    return out ? out : strdup("");
+}
+
+/* reads fd to the end with big reads */
+void read_all(int fd, struct dyn_str *res)
+{
+    int n;
+    for(;;) {
+        if(res->size - res->pos < in_buf_size / 4) {
+            res->size *= 2;
+            res->str = realloc(res->str, res->size);
+        }
+        n = read(fd, res->str + res->pos, res->size - res->pos - 1);
+        if(n == -1 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        res->pos += n;
+    }
+    res->str[res->pos] = '\0';
+}
+
+/* runs the commands and returns their output without trailing newlines */
+char *run_cmdsub(struct node *sub)
+{
+    struct dyn_str res;
+    int fds[2], pid, i;
+    char *out;
+    out = cmdsub_in_place(sub);
+    if(!out) {
+        dstr_init(&res, in_buf_size);
+        res.str[0] = '\0';
+        out = res.str;
+        if(pipe(fds) == -1) {
+            perror("pipe");
+            cmdsub_status = 1;
+            return out;
+        }
+        pid = fork_subshell();
+        if(pid == -1) {
+            perror(SELF_NAME);
+            close(fds[0]);
+            close(fds[1]);
+            cmdsub_status = 1;
+            return out;
+        } else if(pid == 0) {
+            for(i = 0; i < procsub_cnt; i++)
+                close(procsubs[i].fd);
+            close(fds[0]);
+            dup2(fds[1], 1);
+            close(fds[1]);
+            shell_exit(exec_list(sub));
+        }
+        close(fds[1]);
+        read_all(fds[0], &res);
+        close(fds[0]);
+        cmdsub_status = wait_fg_process(pid);
+        out = res.str;
+    }
+    /* strip trailing newlines */
+    for(i = strlen(out); i > 0 && out[i-1] == '\n'; i--)
+        out[i-1] = '\0';
+    return out;
+}
+
+/* returns -1 if an expansion has failed */
+int assign_vars(struct assign *a, int export_f)
+{
+    char *value;
+    for(expand_failed = 0; a; a = a->next) {
+        value = expand_word_str(a->value, 0);
+        /* nothing is assigned from a substitution stopped by ^C */
+        if(expand_failed || interrupted) {
+            free(value);
+            return -1;
+        }
+        if(export_f)
+            setenv(a->name, value, 1);
+        else
+            var_set(a->name, value);
+        free(value);
+    }
+    return 0;
+}
+
+int call_function(struct func_item *fn, char **argv)
+{
+    struct positional saved_params;
+    struct arena *arena;
+    int status, saved_loop_depth;
+    saved_params = pos_params;
+    saved_loop_depth = loop_depth;
+    pos_params.argc = len_argv(argv) - 1;
+    pos_params.argv = argv + 1;
+    loop_depth = 0;
+    func_depth++;
+    /* keep the body alive even if the function redefines itself */
+    arena = fn->arena;
+    arena->refs++;
+    status = exec_node(fn->body);
+    arena_release(arena);
+    func_depth--;
+    return_f = 0;
+    loop_depth = saved_loop_depth;
+    pos_params = saved_params;
+    return status;
+}
+
+void exec_external(struct node *n, char **argv)
+{
+    sync_stdin();
+    if(redirect_streams(n->redirs, NULL) == -1)
+        shell_exit(1);
+    if(assign_vars(n->assigns, 1) == -1)
+        shell_exit(1);
+    signal(SIGTTOU, SIG_DFL);
+    /* a builtin forked to be a job of its own */
+    if(builtin_for(argv))
+        shell_exit(run_builtin(argv));
+    execvp(argv[0], argv);
+    if(errno == ENOENT)
+        fprintf(stderr, "%s: %s: command not found\n",
+                SELF_NAME, argv[0]);
+    else
+        perror(argv[0]);
+    shell_exit(errno == ENOENT ? 127 : 126);
+}
+
+/* if in_place is raised, the process is a child which is going to exit
+ * after the command, so an external command replaces it; the same goes
+ * for a builtin which has to be a job of its own */
+int exec_simple(struct node *n, int in_place)
+{
+    struct fields f;
+    struct func_item *fn;
+    struct builtin *b;
+    char **argv;
+    int pid, status = 0, fdcopies[2] = { -1, -1 };
+    fields_init(&f);
+    expand_failed = 0;
+    cmdsub_status = 0;
+    expand_words(n->words, &f);
+    argv = fields_argv(&f);
+    if(expand_failed) {
+        status = 1;
+        goto cleanup;
+    }
+    /* a substitution has been interrupted by ^C */
+    if(interrupted) {
+        status = 128 + SIGINT;
+        goto cleanup;
+    }
+    if(f.size == 0) {
+        /* the status is the one of the last command substitution */
+        if(assign_vars(n->assigns, 0) == -1 ||
+           redirect_streams(n->redirs, fdcopies) == -1)
+            status = 1;
+        else
+            status = cmdsub_status;
+        restore_streams(fdcopies);
+        goto cleanup;
+    }
+    fn = func_lookup(argv[0]);
+    b = fn ? NULL : builtin_for(argv);
+    if(fn || (b && !(b->own_job && job_control()))) {
+        if(assign_vars(n->assigns, 0) == -1 ||
+           redirect_streams(n->redirs, fdcopies) == -1)
+            status = 1;
+        else
+            status = fn ? call_function(fn, argv) : run_builtin(argv);
+        restore_streams(fdcopies);
+        goto cleanup;
+    }
+    if(in_place)
+        exec_external(n, argv);
+    pid = fork_subshell();
+    if(pid == -1) {
+        perror(SELF_NAME);
+        status = 1;
+        goto cleanup;
+    } else if(pid == 0) {
+        exec_external(n, argv);
+    }
+    if(job_control()) {
+        setpgid(pid, pid);
+        tcsetpgrp(session_tty_fd, pid);
+    }
+    status = wait_fg_process(pid);
+    if(job_control())
+        tcsetpgrp(session_tty_fd, getpid());
+cleanup:
+    fields_free(&f);
+    return status;
+}
+
+void exec_in_subproc(struct node *n)
+{
+    int status;
+    if(n->type == node_cmd)
+        status = exec_simple(n, 1);
+    else
+        status = exec_node(n);
+    if(n->negate)
+        status = !status;
+    shell_exit(status);
+}
+
+int *pipe_n_times(int size)
+{
+    int i, len, *fds;
+    len = (size - 1) * 2;  /* x2 for output and input fds */
+    fds = malloc(sizeof(*fds) * len);
+    for(i = 0; i < len; i+=2) {
+        if(pipe(fds + i) == -1) {  /* exceeded the limit for descriptors */
+            int j;
+            perror("pipe");
+            for(j = 0; j < i; j++)
+                close(fds[j]);
+            free(fds);
+            return NULL;
+        }
+    }
+    return fds;
+}
+
+void close_all_fds(int *fds, int size)
+{
+    int i, len;
+    len = (size - 1) * 2;
+    for(i = 0; i < len; i++)
+        close(fds[i]);
+}
+
+void run_pipeline_member(struct node *n, int *fds, int i)
+{
+    if(i > 0)  /* not the first member */
+        dup2(fds[(i-1)*2], 0);
+    if(i < n->size-1)  /* not the last member */
+        dup2(fds[i*2+1], 1);
+    close_all_fds(fds, n->size);
+    exec_in_subproc(n->cmds[i]);
+}
+
+/* Pipeline members which are calls of builtins not changing the shell
+ * state run on threads of the shell instead of forked children.  The
+ * ends of their pipes are passed in bio in place of fds 0 and 1, and
+ * redirections replace them the same way.  Words of such members are
+ * expanded before any thread starts, so only words whose expansion has no
+ * side effects are allowed: a subshell would not pass them back. */
+
+struct stage {
+    struct node *cmd;
+    struct builtin *b;      /* NULL if the member is forked */
+    struct fields argv;
+    struct fields targets;  /* expanded targets of the redirections */
+    int in_fd, out_fd, status, running;
+    pthread_t thread;
+};
+
+/* under job control the terminal is given to the process group of the
+ * pipeline, while threads stay in the group of the shell, so `cat' which
+ * reads the terminal as the first member is forked */
+int stage_reads_tty(struct stage *st, struct builtin *b, int i)
+{
+    struct redir *r;
+    int k;
+    if(!job_control() || i > 0 || b->fn != cat_cmd || !isatty(0))
+        return 0;
+    for(r = st->cmd->redirs; r; r = r->next)
+        if(r->fd == 0)
+            return 0;
+    for(k = 1; k < st->argv.size; k++)
+        if(0 == strcmp(st->argv.arr[k], "-"))
+            return 1;
+    return st->argv.size == 1;
+}
+
+/* expands the member i if it can run on a thread and sets st->b */
+void prepare_stage(struct stage *st, int i)
+{
+    struct node *n = st->cmd;
+    struct builtin *b;
+    struct redir *r;
+    int count = 0;
+    if(n->type != node_cmd || n->assigns || !n->words || !n->words->lit)
+        return;
+    b = find_builtin(n->words->lit);
+    if(!b || !b->in_place || func_lookup(n->words->lit))
+        return;
+    if(!words_are_pure(n->words))
+        return;
+    for(r = n->redirs; r; r = r->next)
+        if(!word_is_pure(r->target))
+            return;
+    fields_init(&st->targets);
+    for(r = n->redirs; r; r = r->next) {
+        expand_word(r->target, &st->targets);
+        if(st->targets.size != ++count) {
+            /* let the forked member report the ambiguous redirect */
+            fields_free(&st->targets);
             return;
         }
     }
-    exit(code);
+    fields_init(&st->argv);
+    expand_words(n->words, &st->argv);
+    if((b->takes && !b->takes(fields_argv(&st->argv))) ||
+       stage_reads_tty(st, b, i)) {
+        fields_free(&st->argv);
+        fields_free(&st->targets);
+        return;
+    }
+    st->b = b;
 }
 
-void run_builtin(char **argv)
+void *run_stage(void *arg)
 {
-    if(0 == strcmp(argv[0], "cd")) {
-        cd(argv);
-    } else if(0 == strcmp(argv[0], "exit")) {
-        exit_cmd(argv);
+    struct stage *st = arg;
+    struct redir *r;
+    sigset_t pipe_mask, int_mask;
+    struct timespec no_wait = { 0, 0 };
+    int i, fd;
+    /* a reader which has gone must not kill the whole shell: writes just
+     * fail with EPIPE, and the signal is dropped at the end */
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, NULL);
+    /* ^C is left to the main thread, so reads here are not cut short */
+    sigemptyset(&int_mask);
+    sigaddset(&int_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &int_mask, NULL);
+    bio.in_fd = st->in_fd;
+    bio.out_fd = st->out_fd;
+    bio.in_thread = 1;
+    st->status = 0;
+    for(i = 0, r = st->cmd->redirs; r; i++, r = r->next) {
+        fd = open_redirect(r->fd, st->targets.arr[i], r->append_f);
+        if(fd == -1) {
+            st->status = 1;
+            break;
+        }
+        if(r->fd == 0) {
+            if(bio.in_fd != 0)
+                close(bio.in_fd);
+            bio.in_fd = fd;
+        } else {
+            close(bio.out_fd);
+            bio.out_fd = fd;
+        }
     }
-    /* more builtin commands to come... */
+    bio.out = fdopen(bio.out_fd, "w");
+    if(st->status == 0)
+        st->status = st->b->fn(fields_argv(&st->argv));
+    fclose(bio.out);
+    if(bio.in_fd != 0)
+        close(bio.in_fd);
+    if(st->cmd->negate)
+        st->status = !st->status;
+    sigtimedwait(&pipe_mask, NULL, &no_wait);
+    return NULL;
 }
 
-struct cmd_props {
-    int run_in_bg;      /* raised if is a background job */
-    int append_f;       /* raised if there is a `>>' token in cmd */
-    int redir_in_cnt;   /* count of `<' tokens in cmd */
-    int redir_out_cnt;  /* count of `>' tokens in cmd */
-    int is_pipeline;    /* raised if there is a `|' token in cmd */
-    char *filein;       /* file to redirect stdin to */
-    char *fileout;      /* file to redirect stdout to */
-    int *fds;           /* array of file descriptors for pipelines */
-    char ***cmds;       /* array of cmd arrays if there is a pipeline */
-    int size, capacity; /* dynamic array fields for `cmds' */
-};
-
-void cmdp_init(struct cmd_props *cmdp)
+void free_stages(struct stage *stages, int size)
 {
-    cmdp->run_in_bg     = 0;
-    cmdp->append_f      = 0;
-    cmdp->redir_in_cnt  = 0;
-    cmdp->redir_out_cnt = 0;
-    cmdp->is_pipeline   = 0;
-    cmdp->filein        = NULL;
-    cmdp->fileout       = NULL;
-    cmdp->fds           = NULL;
-    cmdp->cmds          = NULL;
-    cmdp->size          = 0;
-    cmdp->capacity      = 0;
+    int i;
+    for(i = 0; i < size; i++) {
+        if(stages[i].b) {
+            fields_free(&stages[i].argv);
+            fields_free(&stages[i].targets);
+        }
+    }
+    free(stages);
 }
 
-int redirect_stdio_stream(int stdfd, const char *fname, int *fdcopy_ptr,
-                          int append_f)
+/* starts threads of the members which are not forked; fds of those
+ * members are closed by the threads, the rest are closed here */
+void start_stages(struct stage *stages, int *fds, int size)
 {
-    int fd, flags;
-    if(stdfd == 0) {
-        flags = O_RDONLY;
-    } else {
-        flags = O_WRONLY | O_CREAT;
-        flags |= append_f ? O_APPEND : O_TRUNC;
-    }
-    fd = open(fname, flags, 0666);
-    if(fd == -1) {
-        perror(fname);
-        return -1;
+    int i;
+    for(i = 0; i < size - 1; i++) {
+        if(!stages[i].b)
+            close(fds[i*2+1]);
+        if(!stages[i+1].b)
+            close(fds[i*2]);
     }
-    if(fdcopy_ptr) {
-        *fdcopy_ptr = dup(stdfd);
-        if(*fdcopy_ptr == -1) {
-            perror("dup");
-            return -1;
+    for(i = 0; i < size; i++) {
+        if(!stages[i].b)
+            continue;
+        stages[i].in_fd = i > 0 ? fds[(i-1)*2] : 0;
+        stages[i].out_fd = i < size-1 ? fds[i*2+1] :
+                           fcntl(1, F_DUPFD_CLOEXEC, 10);
+        if(stages[i].out_fd != -1 &&
+           0 == pthread_create(&stages[i].thread, NULL, run_stage,
+                               &stages[i])) {
+            stages[i].running = 1;
+            continue;
         }
+        fprintf(stderr, "%s: can not start a thread\n", SELF_NAME);
+        if(stages[i].in_fd != 0)
+            close(stages[i].in_fd);
+        if(stages[i].out_fd != -1)
+            close(stages[i].out_fd);
+        stages[i].status = 1;
     }
-    if(dup2(fd, stdfd) == -1) {
-        perror("dup2");
-        if(fdcopy_ptr)
-            *fdcopy_ptr = -1;
-        return -1;
-    }
-    close(fd);
-    return 0;
 }
 
-int redirect_streams(struct cmd_props *cmdp, int *fdcopy_ptr0,
-                     int *fdcopy_ptr1)
+/* returns the status of the last member */
+int wait_pipeline_members(int *pids, struct stage *stages, int size)
 {
-    int res = 0;
-    if(cmdp->filein)
-        res = redirect_stdio_stream(0, cmdp->filein, fdcopy_ptr0,
-                                    cmdp->append_f);
-    if(res == -1)
-        return -1;
-    if(cmdp->fileout)
-        res = redirect_stdio_stream(1, cmdp->fileout, fdcopy_ptr1,
-                                    cmdp->append_f);
-    return res;
+    int i, status = 0;
+    for(i = 0; i < size; i++) {
+        if(!stages[i].b) {
+            status = wait_fg_process(pids[i]);
+            continue;
+        }
+        if(stages[i].running)
+            pthread_join(stages[i].thread, NULL);
+        status = stages[i].status;
+    }
+    return status;
 }
 
-void restore_streams(struct cmd_props *cmdp, int fdcopy0, int fdcopy1)
+int run_pipeline(struct node *n)
 {
-    if(cmdp->filein && fdcopy0 != -1) {
-        dup2(fdcopy0, 0);
-        close(fdcopy0);
+    int i, j, pid, *pids, *fds, pgid = 0, status = 1;
+    struct stage *stages;
+    fds = pipe_n_times(n->size);
+    if(!fds)
+        return 1;
+    pids = malloc(sizeof(*pids) * n->size);
+    stages = calloc(n->size, sizeof(*stages));
+    for(i = 0; i < n->size; i++) {
+        stages[i].cmd = n->cmds[i];
+        prepare_stage(&stages[i], i);
+    }
+    /* threads start only after all the forks, so no child is forked
+     * while a thread holds a lock */
+    for(i = 0; i < n->size; i++) {
+        if(stages[i].b)
+            continue;
+        pid = fork_subshell();
+        if(pid == -1) {
+            perror("fork");
+            break;
+        } else if(pid == 0) {
+            run_pipeline_member(n, fds, i);
+        }
+        if(!pgid)
+            pgid = pid;
+        if(job_control())
+            setpgid(pid, pgid);
+        pids[i] = pid;
     }
-    if(cmdp->fileout && fdcopy1 != -1) {
-        dup2(fdcopy1, 1);
-        close(fdcopy1);
+    if(i < n->size) {
+        close_all_fds(fds, n->size);
+        for(j = 0; j < i; j++)
+            if(!stages[j].b)
+                wait_fg_process(pids[j]);
+    } else {
+        start_stages(stages, fds, n->size);
+        if(job_control() && pgid)
+            tcsetpgrp(session_tty_fd, pgid);
+        status = wait_pipeline_members(pids, stages, n->size);
+        if(job_control())
+            tcsetpgrp(session_tty_fd, getpid());
     }
+    free_stages(stages, n->size);
+    free(pids);
+    free(fds);
+    return status;
 }
 
-void remove_zombies(int s)
-{
-    int p;
-    signal(SIGCHLD, remove_zombies);
-    do {
-        p = wait4(-1, NULL, WNOHANG, NULL);
-    } while(p > 0);
-}
+/* Fan-out: every consumer gets a copy of the output of the producer.  A
+ * relay process duplicates the data between pipes with tee(2), so it is
+ * never copied to user space; a consumer which is slow to read holds the
+ * producer back, as it would in a pipeline. */
 
-void wait_fg_process(int pid)
+enum { relay_chunk = 65536 };
+
+/* drops len bytes from the head of the pipe fd */
+int pipe_discard(int fd, int devnull, int len)
 {
-    int p;
-    do {
-        p = wait(NULL);
-    } while(p != pid && p != -1);
+    int n;
+    while(len > 0) {
+        n = splice(fd, NULL, devnull, NULL, len, 0);
+        if(n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
 }
 
-void exec_in_subproc(char **cmd)
+/* copies the first len bytes of the pipe in_fd to the pipe out_fd without
+ * consuming them; returns -1 if the reader of out_fd has gone */
+int relay_copy(int in_fd, int out_fd, int *scratch, int devnull, int len)
 {
-    if(is_builtin(cmd[0])) {
-        /* TODO: proper exit codes */
-        run_builtin(cmd);
-        exit(0);
+    int done, n;
+    done = tee(in_fd, out_fd, len, 0);
+    if(done == -1)
+        return -1;
+    if(done == len)
+        return 0;
+    /* out_fd took a part only; tee(2) always starts at the head of in_fd,
+     * so the rest is cut out of a full copy in the scratch pipe */
+    if(tee(in_fd, scratch[1], len, 0) != len ||
+       pipe_discard(scratch[0], devnull, done) == -1)
+        return -1;
+    while(done < len) {
+        n = splice(scratch[0], NULL, out_fd, NULL, len - done, 0);
+        if(n <= 0) {
+            pipe_discard(scratch[0], devnull, len - done);
+            return -1;
+        }
+        done += n;
     }
-    execvp(cmd[0], cmd);
-    if(errno == ENOENT)
-        fprintf(stderr, "%s: %s: command not found\n",
-                SELF_NAME, cmd[0]);
-    else
-        perror(cmd[0]);
-    exit(69);
+    return 0;
 }
 
-void run_cmd(char **cmd, struct cmd_props *cmdp)
+/* relays the pipe fds[0] to the write ends of consumer pipes */
+void run_relay(struct node *n, int *fds)
 {
-    int pid, cp0, cp1;
-    if(redirect_streams(cmdp, &cp0, &cp1) == -1)
-        goto restore;
-    if(!cmdp->run_in_bg && is_builtin(cmd[0])) {
-        run_builtin(cmd);
-        goto restore;
-    }
-    pid = fork();
-    if(pid == -1) {
+    int scratch[2], devnull, first, len, i, active = n->size - 1;
+    close(fds[1]);
+    for(i = 1; i < n->size; i++)
+        close(fds[i*2]);
+    devnull = open("/dev/null", O_WRONLY);
+    if(devnull == -1 || pipe(scratch) == -1) {
         perror(SELF_NAME);
-        goto restore;
-    } else if(pid == 0) {
-        exec_in_subproc(cmd);
+        shell_exit(1);
     }
-    setpgid(pid, pid);
-    if(!cmdp->run_in_bg) {
-        tcsetpgrp(session_tty_fd, pid);
-        signal(SIGCHLD, SIG_DFL);
-        wait_fg_process(pid);
-        signal(SIGCHLD, remove_zombies);
-        tcsetpgrp(session_tty_fd, getpid());
+    signal(SIGPIPE, SIG_IGN);
+    while(active > 0) {
+        for(first = 1; fds[first*2+1] == -1; first++)
+            {}
+        /* the first consumer decides how much is relayed at once */
+        len = tee(fds[0], fds[first*2+1], relay_chunk, 0);
+        if(len == 0)
+            break;  /* end of the producer's output */
+        if(len == -1) {
+            close(fds[first*2+1]);
+            fds[first*2+1] = -1;
+            active--;
+            continue;
+        }
+        for(i = first + 1; i < n->size; i++) {
+            if(fds[i*2+1] == -1)
+                continue;
+            if(relay_copy(fds[0], fds[i*2+1], scratch, devnull, len) == -1) {
+                close(fds[i*2+1]);
+                fds[i*2+1] = -1;
+                active--;
+            }
+        }
+        if(pipe_discard(fds[0], devnull, len) == -1)
+            break;
     }
-restore:
-    restore_streams(cmdp, cp0, cp1);
+    shell_exit(0);
 }
 
-void add_redir_info_to_cmdprops(struct cmd_props *cmdp,
-                                struct word_item *cur)
+/* fds[0..1] connect the producer to the relay, fds[i*2..i*2+1] connect
+ * the relay to the consumer i; member n->size is the relay itself */
+void run_fanout_member(struct node *n, int *fds, int i)
 {
-    char *cur_word, *redir_file;
-    cur_word = cur->word;
-    redir_file = cur->next->word;
-    if(cur_word[0] == '<') {
-        cmdp->filein = redir_file;
-        cmdp->redir_in_cnt++;
-    } else {
-        cmdp->fileout = redir_file;
-        cmdp->redir_out_cnt++;
-        if(cur_word[1] == '>')
-            cmdp->append_f = 1;
-    }
+    if(i == n->size)
+        run_relay(n, fds);
+    if(i == 0)
+        dup2(fds[1], 1);
+    else
+        dup2(fds[i*2], 0);
+    close_all_fds(fds, n->size + 1);
+    exec_in_subproc(n->cmds[i]);
 }
 
-void delete_word_item(struct word_item **pcur, int free_word)
+int run_fanout(struct node *n)
 {
-    struct word_item *tmp;
-    tmp = *pcur;
-    if(free_word)
-        free(tmp->word);
-    *pcur = tmp->next;
-    free(tmp);
+    int i, j, pid, *pids, *fds, pgid = 0, status = 1, member_status;
+    fds = pipe_n_times(n->size + 1);
+    if(!fds)
+        return 1;
+    pids = malloc(sizeof(*pids) * (n->size + 1));
+    for(i = 0; i <= n->size; i++) {
+        pid = fork_subshell();
+        if(pid == -1) {
+            perror("fork");
+            break;
+        } else if(pid == 0) {
+            run_fanout_member(n, fds, i);
+        }
+        if(i == 0)
+            pgid = pid;
+        if(job_control())
+            setpgid(pid, pgid);
+        pids[i] = pid;
+    }
+    close_all_fds(fds, n->size + 1);
+    if(job_control() && i > 0)
+        tcsetpgrp(session_tty_fd, pgid);
+    /* the status is the one of the last consumer */
+    for(j = 0; j < i; j++) {
+        member_status = wait_fg_process(pids[j]);
+        if(j == n->size - 1)
+            status = member_status;
+    }
+    if(i <= n->size)
+        status = 1;
+    if(job_control())
+        tcsetpgrp(session_tty_fd, getpid());
+    free(pids);
+    free(fds);
+    return status;
 }
 
-int handle_bg_token(struct cmd_props *cmdp, struct word_item **pcur)
+/* Background jobs which are not waited for.  SIGCHLD is blocked while a
+ * command runs, so they are reaped between the commands of a list too:
+ * a loop starting jobs would fill the process table with zombies. */
+int *bg_pids = NULL;
+int bg_cnt = 0, bg_cap = 0;
+
+void reap_background()
 {
-    if(!(*pcur)->next) {
-        cmdp->run_in_bg = 1;
-        delete_word_item(pcur, 1);
-        return 0;
+    int i;
+    for(i = 0; i < bg_cnt; i++) {
+        if(waitpid(bg_pids[i], NULL, WNOHANG) == 0)
+            continue;
+        /* finished, or reaped by the SIGCHLD handler */
+        bg_pids[i--] = bg_pids[--bg_cnt];
     }
-    fprintf(stderr, "`&' must be the last character in the line\n");
-    return -1;
 }
 
-int handle_redirect_token(struct cmd_props *cmdp, struct word_item **pcur)
+int run_in_background(struct node *n)
 {
-    if(!(*pcur)->next || (*pcur)->next->t_type != token_word) {
-        fprintf(stderr, "File name expected after `%s'\n", (*pcur)->word);
-        return -1;
+    int pid;
+    pid = fork_subshell();
+    if(pid == -1) {
+        perror(SELF_NAME);
+        return 1;
+    } else if(pid == 0) {
+        exec_in_subproc(n);
     }
-    add_redir_info_to_cmdprops(cmdp, *pcur);
-    if(cmdp->redir_in_cnt >= 2 || cmdp->redir_out_cnt >= 2) {
-        fprintf(stderr, "Ambigous redirection\n");
-        return -1;
+    if(job_control())
+        setpgid(pid, pid);
+    last_bg_pid = pid;
+    if(bg_cnt == bg_cap) {
+        bg_cap = bg_cap ? bg_cap * 2 : 4;
+        bg_pids = realloc(bg_pids, sizeof(*bg_pids) * bg_cap);
     }
-    /* delete the token itself and the filename, going after it */
-    delete_word_item(pcur, 1);
-    delete_word_item(pcur, 0);
+    bg_pids[bg_cnt++] = pid;
     return 0;
 }
 
-void cmds_append(struct cmd_props *cmdp, char **cmd)
-{
-    if(cmdp->size == cmdp->capacity) {
-        if(cmdp->size == 0)
-            cmdp->capacity = 1;
-        else
-            cmdp->capacity *= 2;
-        cmdp->cmds = realloc(cmdp->cmds, sizeof(*cmdp->cmds) * cmdp->capacity);
-    }
-    (cmdp->cmds)[cmdp->size] = cmd;
-    (cmdp->size)++;
-}
-
-int handle_pipe_token(struct cmd_props *cmdp, struct word_item **pcur,
-                      struct word_item **sub_cmd_p, int *rel_pos)
+/* consumes a pending break or continue addressed to the current loop;
+ * returns 1 if the loop must stop */
+int loop_should_stop()
 {
-    char **cmd;
-    if(!(*pcur)->next || (*pcur)->next->t_type != token_word) {
-        fprintf(stderr, "Syntax error near unexpected token `|'\n");
-        return -1;
+    if(return_f || interrupted)
+        return 1;
+    if(break_cnt) {
+        break_cnt--;
+        return 1;
     }
-    cmdp->is_pipeline = 1;
-    cmd = wlist2arr(*sub_cmd_p, rel_pos);
-    if(!cmd) {
-        fprintf(stderr, "Syntax error near unexpected token `|'\n");
-        return -1;
+    if(continue_cnt) {
+        continue_cnt--;
+        return continue_cnt > 0;
     }
-    cmds_append(cmdp, cmd);
-
-    delete_word_item(pcur, 1);
-    *sub_cmd_p = *pcur;
-    *rel_pos = 0;
     return 0;
 }
 
-int analyze_expression(struct word_item **wlist, struct cmd_props *cmdp)
+int exec_while(struct node *n)
 {
-    int res, rel_pos = 0;
-    struct word_item *sub_cmd_p = NULL;
-    struct word_item **pcur = wlist;
-    sub_cmd_p = *wlist;
-    while(*pcur) {
-        char *cur_word = (*pcur)->word;
-        if((*pcur)->t_type != token_delimiter) {
-            pcur = &(*pcur)->next;
-            rel_pos++;
+    int status = 0, cond;
+    loop_depth++;
+    for(;;) {
+        cond = exec_list(n->cond);
+        if(jump_pending()) {
+            if(loop_should_stop())
+                break;
             continue;
         }
-        if(*cur_word == '&') {
-            res = handle_bg_token(cmdp, pcur);
-        } else if(*cur_word == '<' || *cur_word == '>') {
-            res = handle_redirect_token(cmdp, pcur);
-        } else if(*cur_word == '|' && cur_word[1] != '|') {
-            res = handle_pipe_token(cmdp, pcur, &sub_cmd_p, &rel_pos);
-        } else {
-            fprintf(stderr, "Feature is not implemented yet\n");
-            return -1;
-        }
-        if(res == -1)
-            return -1;
-    }
-    if(cmdp->is_pipeline) {
-        char **cmd = wlist2arr(sub_cmd_p, &rel_pos);
-        cmds_append(cmdp, cmd);
+        if((cond == 0) != (n->type == node_while))
+            break;
+        status = exec_list(n->body);
+        if(loop_should_stop())
+            break;
     }
-    return 0;
+    loop_depth--;
+    return status;
 }
 
-void make_empty_file(const char *path)
+int exec_for(struct node *n)
 {
-    int fd;
-    fd = open(path, O_CREAT|O_TRUNC, 0666);
-    if(fd == -1) {
-        perror(path);
-        return;
+    struct fields f;
+    int i, status = 0;
+    fields_init(&f);
+    expand_failed = 0;
+    expand_words(n->words, &f);
+    if(expand_failed) {
+        fields_free(&f);
+        return 1;
     }
-    close(fd);
+    loop_depth++;
+    for(i = 0; i < f.size; i++) {
+        var_set(n->name, f.arr[i]);
+        status = exec_list(n->body);
+        if(loop_should_stop())
+            break;
+    }
+    loop_depth--;
+    fields_free(&f);
+    return status;
 }
 
-void free_cmds(char ***cmds, int size)
+/* returns the status of `((expr))': 0 if the value is non-zero */
+int arith_status(struct arith *a)
 {
-    int i;
-    for(i = 0; i < size; i++) {
-        free(cmds[i]);
-    }
-    free(cmds);
+    long long res;
+    if(arith_run(a, &res) == -1)
+        return 2;
+    return res == 0;
 }
 
-void print_cmds(char ***cmds, int size)
+int exec_arith_for(struct node *n)
 {
-    int i;
-    printf("%d\n", size);
-    for(i = 0; i < size; i++) {
-        char **cmd;
-        printf("[ ");
-        for(cmd = cmds[i]; *cmd; cmd++) {
-            printf("%s ", *cmd);
+    int status = 0, cond;
+    if(arith_status(n->arith[0]) == 2)
+        return 1;
+    loop_depth++;
+    for(;;) {
+        cond = n->arith[1] ? arith_status(n->arith[1]) : 0;
+        if(cond != 0) {
+            if(cond == 2)
+                status = 1;
+            break;
+        }
+        status = exec_list(n->body);
+        if(loop_should_stop())
+            break;
+        if(arith_status(n->arith[2]) == 2) {
+            status = 1;
+            break;
         }
-        printf("]\n");
     }
+    loop_depth--;
+    return status;
 }
 
-int pipe_n_times(struct cmd_props *cmdp)
+int exec_case(struct node *n)
 {
-    int i, len, res;
-    len = (cmdp->size - 1) * 2;  /* x2 for output and input fds */
-    cmdp->fds = malloc(sizeof(*cmdp->fds) * len);
-    for(i = 0; i < len; i+=2) {
-        res = pipe(cmdp->fds + i);
-        if(res == -1) {  /* exceeded the limit for descriptors amount */
-            int j;
-            perror("pipe");
-            for(j = 0; j < i; j++)
-                close(cmdp->fds[j]);
-            return -1;
+    struct case_item *item;
+    struct word *pat;
+    char *word, *pattern;
+    int matched;
+    word = expand_word_str(n->words, 0);
+    for(item = n->items; item; item = item->next) {
+        for(pat = item->patterns; pat; pat = pat->next) {
+            pattern = expand_word_str(pat, 1);
+            matched = 0 == fnmatch(pattern, word, 0);
+            free(pattern);
+            if(matched) {
+                free(word);
+                return exec_list(item->body);
+            }
         }
     }
+    free(word);
     return 0;
 }
 
-void close_all_fds(struct cmd_props *cmdp)
+int exec_subshell(struct node *n)
 {
-    int i, len;
-    len = (cmdp->size - 1) * 2;
-    for(i = 0; i < len; i++)
-        close(cmdp->fds[i]);
+    int pid;
+    pid = fork_subshell();
+    if(pid == -1) {
+        perror(SELF_NAME);
+        return 1;
+    } else if(pid == 0) {
+        shell_exit(exec_list(n->body));
+    }
+    return wait_fg_process(pid);
 }
 
-void run_pipeline_member(struct cmd_props *cmdp, int i)
+int exec_compound(struct node *n)
 {
-    if(i == 0) {  /* first member */
-        if(cmdp->filein)
-            redirect_stdio_stream(0, cmdp->filein, NULL, cmdp->append_f);
-        dup2(cmdp->fds[1], 1);
-    } else if(i == cmdp->size-1) {  /* last member */
-        dup2(cmdp->fds[(i-1)*2], 0);
-        if(cmdp->fileout)
-            redirect_stdio_stream(1, cmdp->fileout, NULL, cmdp->append_f);
-    } else {
-        dup2(cmdp->fds[(i-1)*2], 0);
-        dup2(cmdp->fds[i*2+1], 1);
-    }
-    close_all_fds(cmdp);
-    if(is_builtin(*(cmdp->cmds[i]))) {
-        /* TODO: proper exit codes */
-        run_builtin(cmdp->cmds[i]);
-        exit(0);
+    int status;
+    switch(n->type) {
+    case node_pipeline:
+        return run_pipeline(n);
+    case node_fanout:
+        return run_fanout(n);
+    case node_and:
+    case node_or:
+        status = exec_node(n->left);
+        if(!jump_pending() && (status == 0) == (n->type == node_and))
+            status = exec_node(n->right);
+        return status;
+    case node_subshell:
+        return exec_subshell(n);
+    case node_group:
+        return exec_list(n->body);
+    case node_if:
+        status = exec_list(n->cond);
+        if(jump_pending())
+            return status;
+        if(status == 0)
+            return exec_list(n->body);
+        return n->else_part ? exec_list(n->else_part) : 0;
+    case node_while:
+    case node_until:
+        return exec_while(n);
+    case node_for:
+        return exec_for(n);
+    case node_case:
+        return exec_case(n);
+    case node_arith:
+        status = arith_status(n->arith[0]);
+        return status == 2 ? 1 : status;
+    case node_arith_for:
+        return exec_arith_for(n);
+    case node_func:
+        func_define(n->name, n->body, n->arena);
+        return 0;
+    default:
+        return 1;
     }
-    execvp(*(cmdp->cmds[i]), cmdp->cmds[i]);
-    perror(*(cmdp->cmds[i]));
-    exit(33);
 }
 
-int arr_contains(int *arr, int size, int elem)
+int exec_node(struct node *n)
 {
-    int i;
-    for(i = 0; i < size; i++) {
-        if(arr[i] == elem)
-            return 1;
+    int status, fdcopies[2] = { -1, -1 }, mark = procsub_cnt;
+    if(n->type == node_cmd) {
+        status = exec_simple(n, 0);
+    } else {
+        if(redirect_streams(n->redirs, fdcopies) == -1)
+            status = 1;
+        else
+            status = exec_compound(n);
+        restore_streams(fdcopies);
     }
-    return 0;
+    reap_procsubs(mark);
+    if(n->negate)
+        status = !status;
+    last_status = status;
+    return status;
 }
 
-void wait_pipeline_members(int *pids, int pids_size, int pids_left)
+int exec_list(struct node *n)
 {
-    int res;
-    signal(SIGCHLD, SIG_DFL);
-    while(pids_left > 0) {
-        res = wait(NULL);
-        if(res == -1)
+    int status = 0;
+    for(; n; n = n->next) {
+        if(n->run_in_bg)
+            status = last_status = run_in_background(n);
+        else
+            status = exec_node(n);
+        if(bg_cnt)
+            reap_background();
+        if(jump_pending())
             break;
-        if(arr_contains(pids, pids_size, res))
-            pids_left--;
     }
-    signal(SIGCHLD, remove_zombies);
+    return status;
 }
 
-int run_pipeline(struct cmd_props *cmdp)
+void eval(struct node *prog)
 {
-    int res, i, *pids, pgid;
-    pids = malloc(sizeof(*pids) * cmdp->size);
-    res = pipe_n_times(cmdp);
-    if(res == -1)
-        goto end_pipeline;
-    for(i = 0; i < cmdp->size; i++) {
-        res = fork();
-        if(res == -1) {
-            perror("fork");
-            break;
-        } else if(res == 0) {
-            run_pipeline_member(cmdp, i);
-        }
-        if(i == 0)
-            pgid = res;
-        setpgid(res, pgid);
-        pids[i] = res;
-    }
-    close_all_fds(cmdp);
-    if(!cmdp->run_in_bg) {
-        tcsetpgrp(session_tty_fd, pgid);
-        wait_pipeline_members(pids, cmdp->size, i);
-        tcsetpgrp(session_tty_fd, getpid());
+    /* children are reaped by the SIGCHLD handler only between commands,
+     * so it does not steal exit statuses of foreground jobs */
+    sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+    exec_list(prog);
+    sigprocmask(SIG_UNBLOCK, &sigchld_mask, NULL);
+    if(interrupted) {
+        interrupted = 0;
+        last_status = 128 + SIGINT;
+        fputc('\n', stderr);
     }
-end_pipeline:
-    free(pids);
-    return res;
 }
 
-void eval(struct word_item **wlist)
+/* tokenizes, parses and executes the text accumulated in dline */
+int parse_and_eval(struct dyn_str *dline)
 {
-    int res;
-    char **cmd;
-    struct cmd_props cmdp;
-    cmd = NULL;
-    cmdp_init(&cmdp);
-    res = analyze_expression(wlist, &cmdp);
-    if(res == -1)
-        goto cleanup;
-    if(cmdp.is_pipeline) {
-        run_pipeline(&cmdp);
-        goto cleanup;
-    }
-    if(!*wlist) {
-        /* truncate file if cmd is `>file' */
-        if(cmdp.fileout && !cmdp.append_f)
-            make_empty_file(cmdp.fileout);
-        goto cleanup;
+    int status;
+    struct word_item *wlist;
+    struct arena *arena;
+    struct node *prog;
+    dstr_append(dline, '\0');
+    (dline->pos)--;
+    wlist = tokenize_line(dline->str, &status);
+    if(status != code_succ) {
+        wlist_free(wlist);
+        return status;
     }
-    cmd = wlist2arr(*wlist, NULL);
-    run_cmd(cmd, &cmdp);
-cleanup:
-    free(cmdp.filein);
-    free(cmdp.fileout);
-    free_cmds(cmdp.cmds, cmdp.size);
-    free(cmdp.fds);
-    free(cmd);
+    arena = arena_new();
+    prog = parse_program(wlist, arena, &status);
+    wlist_free(wlist);
+    if(status == code_succ)
+        eval(prog);
+    else if(status == code_syntax_err)
+        last_status = 2;
+    arena_release(arena);
+    return status;
 }
 
-/* TODO: use isatty(3) in the future for `prompt' functions */
-
-void print_prompt(FILE *filein, FILE *fileout)
+void print_prompt(FILE *filein, FILE *fileout, int continuation)
 {
-    if(filein == stdin)
-        fputs("% ", fileout);
+    if(filein == stdin && isatty(0)) {
+        fputs(continuation ? "> " : "% ", fileout);
+        fflush(fileout);
+    }
 }
 
 void close_prompt(FILE *filein, FILE *fileout)
 {
-    if(filein == stdin)
+    if(filein == stdin && isatty(0))
         fputc('\n', fileout);
 }
 
@@ -780,51 +4615,216 @@ void print_error_msg(int status)
 {
     switch(status) {
     case code_quot_msmtch:
-        fprintf(stderr, "Error: unmatched quotes\n");
+        fprintf(stderr, "Error: unmatched quotes or parentheses\n");
+        break;
+    case code_incomplete:
+        fprintf(stderr, "Syntax error: unexpected end of file\n");
         break;
     default:
     }
 }
 
+int needs_more_input(int status)
+{
+    return status == code_quot_msmtch || status == code_incomplete;
+}
+
+/* Lines of a compound command are only tokenized one by one to count the
+ * constructs they open and close, so the whole text is parsed once, when
+ * the count drops to zero.  The count is a hint: the parser still decides
+ * whether the text is complete. */
+struct line_scan {
+    int from;               /* offset of the first line not scanned yet */
+    int depth;              /* count of open compound commands */
+    int cmd_start;          /* raised if a command may start at a token */
+    int case_words;         /* words left up to `in' of a case */
+    int pattern;            /* raised if case patterns are expected */
+};
+
+void line_scan_reset(struct line_scan *ls)
+{
+    ls->from = 0;
+    ls->depth = 0;
+    ls->cmd_start = 1;
+    ls->case_words = 0;
+    ls->pattern = 0;
+}
+
+void line_scan_token(struct line_scan *ls, struct word_item *t)
+{
+    static const char *const openers[] = { "if", "while", "until", "{",
+                                           "for", "case", NULL };
+    static const char *const closers[] = { "fi", "done", "}", "esac", NULL };
+    static const char *const leaders[] = { "then", "do", "else", "elif",
+                                           "!", NULL };
+    int i;
+    if(ls->pattern) {
+        /* words up to `)' are patterns, even if they look like keywords */
+        if(t->t_type == token_word && 0 == strcmp(t->word, "esac")) {
+            ls->depth--;
+            ls->pattern = 0;
+            ls->cmd_start = 0;
+        } else if(t->t_type == token_delimiter && *t->word == ')') {
+            ls->pattern = 0;
+            ls->cmd_start = 1;
+        }
+        return;
+    }
+    if(t->t_type == token_delimiter) {
+        /* a file name follows a redirection, a pattern follows `;;' */
+        if(0 == strcmp(t->word, ";;"))
+            ls->pattern = 1;
+        else
+            ls->cmd_start = !strchr("<>", *t->word);
+        return;
+    }
+    if(ls->case_words) {
+        /* the word of a case, then `in' */
+        ls->case_words--;
+        ls->pattern = ls->case_words == 0;
+        return;
+    }
+    if(!ls->cmd_start)
+        return;
+    for(i = 0; openers[i]; i++) {
+        if(0 == strcmp(t->word, openers[i])) {
+            ls->depth++;
+            /* `for' and `case' are followed by a name and a word */
+            ls->cmd_start = i < 4;
+            if(0 == strcmp(t->word, "case"))
+                ls->case_words = 2;
+            return;
+        }
+    }
+    for(i = 0; closers[i]; i++) {
+        if(0 == strcmp(t->word, closers[i])) {
+            ls->depth--;
+            ls->cmd_start = 0;
+            return;
+        }
+    }
+    for(i = 0; leaders[i]; i++)
+        if(0 == strcmp(t->word, leaders[i]))
+            return;
+    ls->cmd_start = 0;
+}
+
+/* scans the lines added to dline since the last call; returns 1 if a
+ * compound command is still open */
+int line_scan_open(struct line_scan *ls, struct dyn_str *dline)
+{
+    struct word_item *wlist, *t;
+    int status;
+    dstr_append(dline, '\0');
+    (dline->pos)--;
+    wlist = tokenize_line(dline->str + ls->from, &status);
+    if(status == code_succ) {
+        for(t = wlist; t; t = t->next)
+            line_scan_token(ls, t);
+        ls->from = dline->pos;
+    }
+    wlist_free(wlist);
+    /* an unmatched quote is waited for in the same way */
+    return status != code_succ || ls->depth > 0;
+}
+
 void read_lines(FILE *filein, FILE *fileout)
 {
-    int c;
+    int c, status;
     struct dyn_str dline;
-    struct word_item *wlist;
+    struct line_scan ls;
     dstr_init(&dline, line_init_size);
-    wlist = NULL;
-    print_prompt(filein, fileout);
-    while((c = fgetc(filein)) != EOF) {
-        int status;
-        if(c != '\n') {
-            dstr_append(&dline, c);
+    line_scan_reset(&ls);
+    print_prompt(filein, fileout, 0);
+    for(;;) {
+        c = fgetc(filein);
+        if(c == EOF && interrupted) {
+            /* ^C at the prompt drops the lines typed so far */
+            clearerr(filein);
+            interrupted = 0;
+            last_status = 128 + SIGINT;
+            dline.pos = 0;
+            line_scan_reset(&ls);
+            fputc('\n', fileout);
+            print_prompt(filein, fileout, 0);
+            continue;
+        }
+        if(c == EOF)
+            break;
+        dstr_append(&dline, c);
+        if(c != '\n')
+            continue;
+        if(line_scan_open(&ls, &dline)) {
+            print_prompt(filein, fileout, 1);
+            continue;
+        }
+        status = parse_and_eval(&dline);
+        if(needs_more_input(status)) {
+            print_prompt(filein, fileout, 1);
             continue;
         }
-        dstr_append(&dline, '\0');
-        /* TODO: env variables expansion; `*`, `?` patterns matching */
-        wlist = tokenize_line(dline.str, &status);
-        if(status == code_succ && wlist)
-            eval(&wlist);
-        else
-            print_error_msg(status);
-        wlist_free(wlist);
         dline.pos = 0;
-        print_prompt(filein, fileout);
+        line_scan_reset(&ls);
+        print_prompt(filein, fileout, 0);
+    }
+    if(dline.pos > 0) {
+        /* the last line has no trailing newline or is incomplete */
+        if(dline.str[dline.pos-1] != '\n')
+            dstr_append(&dline, '\n');
+        status = parse_and_eval(&dline);
+        if(needs_more_input(status)) {
+            print_error_msg(status);
+            last_status = 2;
+        }
     }
     close_prompt(filein, fileout);
     free(dline.str);
 }
 
-int main()
+void catch_sigint(int s)
 {
-    session_tty_fd = open("/dev/tty", O_RDWR);
-    if(session_tty_fd == -1) {
-        perror("/dev/tty");
-        return 1;
+    interrupted = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+    FILE *filein = stdin;
+    shell_pid = getpid();
+    import_environ();
+    if(argc > 1) {
+        /* shell script [arg ...] */
+        filein = fopen(argv[1], "r");
+        if(!filein) {
+            perror(argv[1]);
+            return 127;
+        }
+        shell_name = argv[1];
+        pos_params.argc = argc - 2;
+        pos_params.argv = argv + 2;
+    }
+    session_tty_fd = -1;
+    if(filein == stdin && isatty(0)) {
+        session_tty_fd = open("/dev/tty", O_RDWR);
+        if(session_tty_fd == -1) {
+            perror("/dev/tty");
+            return 1;
+        }
     }
+    atexit(sync_stdin);
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
     signal(SIGCHLD, remove_zombies);
     signal(SIGTTOU, SIG_IGN);
-    read_lines(stdin, stdout);
-    close(session_tty_fd);
-    return 0;
+    if(session_tty_fd != -1) {
+        /* no SA_RESTART: ^C makes a blocking read of the shell return */
+        sa.sa_handler = catch_sigint;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        sigaction(SIGINT, &sa, NULL);
+    }
+    read_lines(filein, stdout);
+    if(session_tty_fd != -1)
+        close(session_tty_fd);
+    return last_status;
 }